@@ -42,6 +42,7 @@
 #include <wlr/types/wlr_output.h>
 #include <wlr/types/wlr_output_layout.h>
 #include <wlr/types/wlr_pointer.h>
+#include <wlr/types/wlr_presentation_time.h>
 #include <wlr/types/wlr_primary_selection_v1.h>
 #include <wlr/types/wlr_scene.h>
 #include <wlr/types/wlr_seat.h>
@@ -60,6 +61,7 @@
 #include "qubes_allocator.h"
 #include "qubes_backend.h"
 #include "qubes_output.h"
+#include "qubes_render_pool.h"
 #include "qubes_wayland.h"
 #include "qubes_xwayland.h"
 #include <qubes-gui-protocol.h>
@@ -81,26 +83,60 @@ struct tinywl_output {
 	struct wlr_output *wlr_output;
 };
 
-static void qubes_send_frame_done(struct wlr_scene_buffer *surface,
-                                  int sx __attribute__((unused)),
-                                  int sy __attribute__((unused)), void *data)
+static void qubes_allocator_pressure(struct wl_listener *listener, void *data)
 {
-	wlr_scene_buffer_send_frame_done(surface, data);
+	struct tinywl_server *server =
+	   wl_container_of(listener, server, allocator_pressure);
+	struct qubes_allocator_pressure_event *event = data;
+	struct qubes_output *output;
+	uint32_t released = 0;
+
+	/* Hidden windows first, as they will not need their buffers soon */
+	wl_list_for_each (output, &server->views, link) {
+		if (released >= event->pages)
+			return;
+		if (qubes_output_hidden(output))
+			released += qubes_output_drop_spare_buffers(output);
+	}
+	wl_list_for_each (output, &server->views, link) {
+		if (released >= event->pages)
+			return;
+		if (!qubes_output_hidden(output))
+			released += qubes_output_drop_spare_buffers(output);
+	}
 }
 
-static int qubes_send_frame_callbacks(void *data)
+/* Release the buffers of windows that have been hidden for 30 seconds */
+#define QUBES_DEFAULT_HIDDEN_RECLAIM_MS 30000
+
+/* Clients of hidden windows get one frame callback a second */
+#define QUBES_DEFAULT_HIDDEN_FRAME_MS 1000
+
+/* Frame pacing, in millihertz like wlroots refresh rates */
+#define QUBES_DEFAULT_REFRESH_MHZ 60000
+#define QUBES_MIN_REFRESH_MHZ 1000
+#define QUBES_MAX_REFRESH_MHZ 1000000
+
+/*
+ * Roughly what a MSG_SHMIMAGE costs the GUI daemon in setting up an
+ * XShmPutImage, expressed as the pixels it could have copied instead
+ */
+#define QUBES_DEFAULT_DAMAGE_MESSAGE_COST 4096
+
+/* More workers than this only contend for memory bandwidth */
+#define QUBES_MAX_RENDER_THREADS 64
+
+static int qubes_dump_stats(int signal_number, void *data)
 {
 	struct tinywl_server *server = data;
-	struct timespec now;
 	struct qubes_output *output;
-	assert(clock_gettime(CLOCK_MONOTONIC, &now) == 0);
-	server->frame_pending = false;
-	wl_list_for_each (output, &server->views, link) {
-		output->output.frame_pending = false;
-		wlr_output_send_frame(&output->output);
-		wlr_scene_node_for_each_buffer(&output->scene_output->scene->tree.node,
-		                               qubes_send_frame_done, &now);
-	}
+
+	qubes_allocator_dump_stats(server->allocator, stderr);
+	fprintf(stderr, "Frame ticks: %" PRIu64 "\n", server->frame_clock.ticks);
+	fputs("Windows:\n", stderr);
+	wl_list_for_each (output, &server->views, link)
+		qubes_output_dump_stats(output, stderr);
+	fflush(stderr);
 	return 0;
 }
 
@@ -333,17 +369,96 @@ static _Noreturn void usage(char *name, int status)
 		"   layout cannot be switched to. \"exit\" means to exit with status\n"
 		"   78. \"continue\" means to continue using the old layout.\n"
 		"   \"continue\" is the default.\n"
+	   " --buffer-pool-pages [pages]:\n"
+	   "   Maximum number of grant pages kept mapped after the buffers that\n"
+		"   used them are freed, so that they can be reused without new grant\n"
+		"   allocations. 0 disables the pool. The default is 4096.\n"
+	   " --allocator [gntalloc|shm]:\n"
+	   "   Choose where window buffers are allocated. \"gntalloc\" (the\n"
+		"   default) uses Xen grant tables. \"shm\" uses POSIX shared memory\n"
+		"   with fake grant references, so that the rendering pipeline can\n"
+		"   be tested and profiled without /dev/xen/gntalloc. QubesDB is\n"
+		"   still needed, but the GUI daemon must not connect: the fake\n"
+		"   references could name other grants, so the compositor exits\n"
+		"   when a GUI daemon connects while \"shm\" is used.\n"
+	   " --async-teardown boolean-option:\n"
+	   "   Enable or disable releasing freed buffers on a helper thread.\n"
+		"   Unmapping and ungranting a large buffer can take long enough\n"
+		"   to delay input and frames for every client, so the default\n"
+		"   is enabled. The same thread also prepares buffers that new and\n"
+		"   resized windows are about to need.\n"
+	   " --hidden-reclaim-delay [milliseconds|never]:\n"
+	   "   Release the buffers of windows that have been minimized or\n"
+		"   unmapped for this long. They are rebuilt when the window is\n"
+		"   shown again. The default is 30000 (30 seconds).\n"
+	   " --hidden-frame-interval [milliseconds|never]:\n"
+	   "   How often clients of minimized or unmapped windows get frame\n"
+		"   callbacks. Such windows are not rendered; their damage is sent\n"
+		"   in one update when they are shown again. \"never\" stops frame\n"
+		"   callbacks until then. The default is 1000 (once a second).\n"
+		"   Unmapped windows, and windows whose buffers were released,\n"
+		"   get none until they are shown.\n"
+	   " --window-arenas boolean-option:\n"
+	   "   Enable or disable allocating all of a window's buffers from a\n"
+		"   single grant region, which needs fewer grant allocations and\n"
+		"   mappings but reserves memory for several buffers up front.\n"
+		"   The default is disabled.\n"
+	   " --damage-message-cost [pixels]:\n"
+	   "   How many pixels sending one damage rectangle to the GUI daemon\n"
+		"   is assumed to cost on top of the pixels it covers. Damage\n"
+		"   rectangles are merged whenever that sends fewer pixels than\n"
+		"   the merge saves in messages. 0 disables merging. The default\n"
+		"   is 4096.\n"
+	   " --refresh-rate [millihertz]:\n"
+	   "   Refresh rate that frames are paced to, in millihertz. Frame\n"
+		"   events are sent at multiples of the refresh interval, and only\n"
+		"   to windows that drew since the previous one. The default is\n"
+		"   to use /qubes-gui-refresh-rate from QubesDB (also in\n"
+		"   millihertz) and follow its changes, or 60000 (60 Hz) if that\n"
+		"   is not set.\n"
+	   " --damage-diff boolean-option:\n"
+	   "   Enable or disable comparing damaged pixels against the previous\n"
+		"   frame, so that only the parts that really changed are sent to\n"
+		"   the GUI daemon. This helps with clients that damage their whole\n"
+		"   surface on every commit, at the cost of reading both frames.\n"
+		"   The default is disabled.\n"
+	   " --zero-copy boolean-option:\n"
+	   "   Enable or disable granting the pages of client buffers to the\n"
+		"   GUI daemon directly. Windows consisting of a single wl_shm\n"
+		"   buffer in a suitable format are then sent without being\n"
+		"   composited. Needs /dev/udmabuf and /dev/xen/gntdev, and only\n"
+		"   works for clients whose wl_shm pools are memfds sealed with\n"
+		"   F_SEAL_SHRINK; other buffers are composited as usual. The\n"
+		"   default is disabled.\n"
+	   " --render-threads [count]:\n"
+	   "   Composite the damage of each window in tiles on this many worker\n"
+		"   threads in addition to the main thread, so that large windows\n"
+		"   render faster on machines with several CPUs. The frames of all\n"
+		"   windows that are due at the same time share the threads, so a\n"
+		"   large window does not hold up the others. Scenes that need\n"
+		"   scaling or translucency, and the pixels of clients whose wl_shm\n"
+		"   pools are not memfds sealed against shrinking, are still\n"
+		"   handled on the main thread.\n"
+		"   The default is 0, which composites everything on the main\n"
+		"   thread.\n"
 	   "\n"
 	   "For boolean option arguments, \"yes\", \"1\", \"enabled\", and \"true\"\n"
 	   "are considered true, \"no\", \"0\", \"disabled\", and \"false\" are\n"
-	   "considered false, and anything else is an error.\n",
+	   "considered false, and anything else is an error.\n"
+	   "\n"
+	   "Sending SIGUSR1 dumps buffer allocation statistics to standard\n"
+	   "error.\n",
 	   name);
 	if (ferror(stdout) || ferror(stderr) || fflush(NULL))
 		exit(1);
 	exit(status);
 }
 
-static void raise_grant_limit(void)
+/*
+ * Raises the gntalloc grant limit and returns the limit in effect afterwards,
+ * or 0 if it is not known.
+ */
+static unsigned long raise_grant_limit(void)
 {
 #ifdef __linux__
 	static const char *const path = "/sys/module/xen_gntalloc/parameters/limit";
@@ -351,7 +466,7 @@ static void raise_grant_limit(void)
 	if (-1 == params_fd) {
 		if (errno != ENOENT)
 			err(1, "Cannot open %s", path);
-		return;
+		return 0;
 	}
 	char buf[256];
 	// FIXME this might require multiple reads
@@ -372,7 +487,7 @@ static void raise_grant_limit(void)
 	if (errno || !endptr || *endptr)
 		err(1, "Invalid grant limit from %s", path);
 	if (l >= (1UL << 30))
-		return;
+		return l;
 	const char to_write[] = "1073741824";
 	if (close(params_fd))
 		err(1, "close(%s)", path);
@@ -380,7 +495,7 @@ static void raise_grant_limit(void)
 	if (params_fd == -1) {
 		warn("Cannot raise grant table limit: opening %s for writing failed",
 		     path);
-		return;
+		return l;
 	}
 	ssize_t status = write(params_fd, to_write, sizeof to_write - 1);
 	if (status == -1)
@@ -389,6 +504,9 @@ static void raise_grant_limit(void)
 		errx(1, "Failed to write full buffer");
 	if (close(params_fd))
 		err(1, "close(%s)", path);
+	return 1UL << 30;
+#else
+	return 0;
 #endif
 }
 
@@ -435,7 +553,12 @@ static uint16_t get_gui_domain_xid(qdb_handle_t qdb, char *domid_str)
 	return domid;
 }
 
-static void check_single_threaded(void)
+/*
+ * Check that the only threads running are the main thread and the helper
+ * threads the compositor started itself.  Helper threads must block all
+ * signals, as signals are received via signalfd.
+ */
+static void check_thread_count(size_t expected_threads)
 {
 #ifdef __linux__
 	// This is not racy, assuming the kernel returns a consistent snapshot
@@ -462,8 +585,9 @@ static void check_single_threaded(void)
 		err(1, "readdir");
 	if (!got_dot || !got_dotdot)
 		errx(1, "No . or .. in /proc/self/task?");
-	if (thread_count != 1)
-		errx(1, "Multiple threads running?");
+	if (thread_count != expected_threads)
+		errx(1, "Expected %zu threads but found %zu", expected_threads,
+		     thread_count);
 	closedir(dir);
 #endif
 }
@@ -545,6 +669,60 @@ static void qubes_refresh_keyboard_layout(struct tinywl_server *server)
 	}
 }
 
+/* The backend output has a single fixed mode, which is updated in place */
+static void qubes_commit_refresh_rate(struct qubes_backend *backend,
+                                      uint32_t refresh_mhz)
+{
+	struct wlr_output_state state;
+	backend->mode.refresh = (int32_t)refresh_mhz;
+	wlr_output_state_init(&state);
+	wlr_output_state_set_mode(&state, &backend->mode);
+	wlr_output_commit_state(backend->output, &state);
+	wlr_output_state_finish(&state);
+}
+
+static void qubes_set_refresh_rate(struct tinywl_server *server,
+                                   uint32_t refresh_mhz)
+{
+	if (refresh_mhz == server->refresh_mhz)
+		return;
+	wlr_log(WLR_INFO, "Refresh rate changed from %" PRIu32 " to %" PRIu32
+	        " mHz", server->refresh_mhz, refresh_mhz);
+	server->refresh_mhz = refresh_mhz;
+	qubes_frame_clock_set_refresh(&server->frame_clock, refresh_mhz);
+	qubes_commit_refresh_rate(server->backend, refresh_mhz);
+	/* Window outputs commit the new mode with the frame scheduled here, see
+	 * qubes_output_wants_frame() */
+	struct qubes_output *output;
+	wl_list_for_each (output, &server->views, link) {
+		wlr_output_schedule_frame(&output->output);
+	}
+}
+
+static void qubes_refresh_refresh_rate(struct tinywl_server *server)
+{
+	char *refresh_str =
+	   qdb_read(server->qubesdb_connection, "/qubes-gui-refresh-rate", NULL);
+	if (!refresh_str) {
+		if (errno == ENOENT)
+			qubes_set_refresh_rate(server, QUBES_DEFAULT_REFRESH_MHZ);
+		else
+			wlr_log(WLR_ERROR, "Cannot read refresh rate from qubesdb: %m");
+		return;
+	}
+	/* Not strict_strtoul(), as a bad value must not be fatal here */
+	char *endptr = NULL;
+	errno = 0;
+	unsigned long const refresh_mhz = strtoul(refresh_str, &endptr, 10);
+	if (errno || endptr == refresh_str || *endptr != '\0' ||
+	    refresh_mhz < QUBES_MIN_REFRESH_MHZ || refresh_mhz > QUBES_MAX_REFRESH_MHZ)
+		wlr_log(WLR_ERROR, "Ignoring invalid refresh rate '%s' from qubesdb",
+		        refresh_str);
+	else
+		qubes_set_refresh_rate(server, (uint32_t)refresh_mhz);
+	free(refresh_str);
+}
+
 static int qubes_reap_watches(int fd, uint32_t mask, void *data)
 {
 	struct tinywl_server *server = data;
@@ -557,6 +735,9 @@ static int qubes_reap_watches(int fd, uint32_t mask, void *data)
 	} else if (!strcmp(ev, "/keyboard-layout")) {
 		free(ev);
 		qubes_refresh_keyboard_layout(server);
+	} else if (!strcmp(ev, "/qubes-gui-refresh-rate")) {
+		free(ev);
+		qubes_refresh_refresh_rate(server);
 	} else if (!strcmp(ev, "/qubes-gui-domain-xid")) {
 		free(ev);
 		wlr_log(WLR_ERROR, "Not yet implemented: changing GUI domain XID");
@@ -633,6 +814,14 @@ int main(int argc, char *argv[])
 	bool primary_selection = false;
 	bool override_verbosity = false;
 	bool handle_sigint = false;
+	char *pool_pages_str = NULL;
+	bool async_teardown = true;
+	char *hidden_reclaim_str = NULL;
+	char *hidden_frame_str = NULL;
+	char *damage_cost_str = NULL;
+	char *refresh_str = NULL;
+	char *render_threads_str = NULL;
+	enum qubes_allocator_backend allocator_backend = QUBES_ALLOCATOR_GNTALLOC;
 	struct option long_options[] = {
 		{ "startup-cmd", required_argument, 0, 's' },
 		{ "log-level", required_argument, 0, 'v' },
@@ -642,6 +831,17 @@ int main(int argc, char *argv[])
 		{ "primary-selection", required_argument, 0, 'p' },
 		{ "xwayland", required_argument, 0, 'x' },
 		{ "keymap-errors", required_argument, 0, 'k' },
+		{ "buffer-pool-pages", required_argument, 0, 'B' },
+		{ "allocator", required_argument, 0, 'A' },
+		{ "async-teardown", required_argument, 0, 'T' },
+		{ "hidden-reclaim-delay", required_argument, 0, 'R' },
+		{ "hidden-frame-interval", required_argument, 0, 'H' },
+		{ "window-arenas", required_argument, 0, 'W' },
+		{ "damage-message-cost", required_argument, 0, 'D' },
+		{ "damage-diff", required_argument, 0, 'F' },
+		{ "refresh-rate", required_argument, 0, 'r' },
+		{ "zero-copy", required_argument, 0, 'Z' },
+		{ "render-threads", required_argument, 0, 'J' },
 		{ NULL, 0, 0, 0 },
 	};
 	int last_option;
@@ -677,6 +877,44 @@ int main(int argc, char *argv[])
 			else
 				usage(argv[0], 1);
 			break;
+		case 'B':
+			pool_pages_str = optarg;
+			break;
+		case 'A':
+			if (strcmp(optarg, "gntalloc") == 0)
+				allocator_backend = QUBES_ALLOCATOR_GNTALLOC;
+			else if (strcmp(optarg, "shm") == 0)
+				allocator_backend = QUBES_ALLOCATOR_SHM;
+			else
+				usage(argv[0], 1);
+			break;
+		case 'T':
+			async_teardown = parse_bool_option(optarg);
+			break;
+		case 'R':
+			hidden_reclaim_str = optarg;
+			break;
+		case 'H':
+			hidden_frame_str = optarg;
+			break;
+		case 'W':
+			server->window_arenas = parse_bool_option(optarg);
+			break;
+		case 'D':
+			damage_cost_str = optarg;
+			break;
+		case 'F':
+			server->damage_diff = parse_bool_option(optarg);
+			break;
+		case 'r':
+			refresh_str = optarg;
+			break;
+		case 'Z':
+			server->zero_copy = parse_bool_option(optarg);
+			break;
+		case 'J':
+			render_threads_str = optarg;
+			break;
 		default:
 			warn("Unknown option %s", argv[last_option]);
 			usage(argv[0], 1);
@@ -686,7 +924,7 @@ int main(int argc, char *argv[])
 		usage(argv[0], 1);
 
 	// Raise the grant table limit
-	raise_grant_limit();
+	const unsigned long grant_limit = raise_grant_limit();
 
 	// Drop root privileges
 	drop_privileges();
@@ -712,7 +950,36 @@ int main(int argc, char *argv[])
 	if (!domid_str && !qdb_watch(qdb, "/qubes-gui-domain-xid"))
 		err(1, "Cannot watch for GUI domain changes");
 
+	if (!refresh_str && !qdb_watch(qdb, "/qubes-gui-refresh-rate"))
+		err(1, "Cannot watch for refresh rate changes");
+
 	server->magic = QUBES_SERVER_MAGIC;
+	if (hidden_reclaim_str == NULL)
+		server->hidden_reclaim_ms = QUBES_DEFAULT_HIDDEN_RECLAIM_MS;
+	else if (strcmp(hidden_reclaim_str, "never") == 0)
+		server->hidden_reclaim_ms = -1;
+	else
+		server->hidden_reclaim_ms = (int32_t)strict_strtoul(
+		   hidden_reclaim_str, "hidden window reclaim delay", INT32_MAX);
+	if (hidden_frame_str == NULL)
+		server->hidden_frame_ms = QUBES_DEFAULT_HIDDEN_FRAME_MS;
+	else if (strcmp(hidden_frame_str, "never") == 0)
+		server->hidden_frame_ms = -1;
+	else
+		server->hidden_frame_ms = (int32_t)strict_strtoul(
+		   hidden_frame_str, "hidden window frame interval", INT32_MAX);
+	server->damage_message_cost =
+	   damage_cost_str ? (uint32_t)strict_strtoul(damage_cost_str,
+	                                               "damage message cost",
+	                                               UINT32_MAX)
+	                   : QUBES_DEFAULT_DAMAGE_MESSAGE_COST;
+	server->refresh_mhz =
+	   refresh_str ? (uint32_t)strict_strtoul(refresh_str, "refresh rate",
+	                                          QUBES_MAX_REFRESH_MHZ)
+	               : QUBES_DEFAULT_REFRESH_MHZ;
+	if (server->refresh_mhz < QUBES_MIN_REFRESH_MHZ)
+		errx(1, "Refresh rate %" PRIu32 " mHz is too low, must be at least %d",
+		     server->refresh_mhz, QUBES_MIN_REFRESH_MHZ);
 	server->domid = domid;
 	server->listening_socket = -1;
 	server->qubesdb_connection = qdb;
@@ -724,13 +991,46 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
-	if (!(server->allocator = qubes_allocator_create(domid)))
+	if (!(server->allocator =
+	         qubes_allocator_create(domid, allocator_backend)))
 		err(1, "Cannot create Qubes OS allocator");
+	if (pool_pages_str)
+		qubes_allocator_set_pool_limit(
+		   server->allocator,
+		   (uint32_t)strict_strtoul(pool_pages_str, "buffer pool size",
+		                            UINT32_MAX));
+	qubes_allocator_set_grant_limit(
+	   server->allocator, (uint32_t)QUBES_MIN(grant_limit, UINT32_MAX));
+	if (server->zero_copy && !qubes_allocator_enable_import(server->allocator)) {
+		warn("Cannot grant client buffers, compositing them instead");
+		server->zero_copy = false;
+	}
+	server->allocator_pressure.notify = qubes_allocator_pressure;
+	qubes_allocator_add_pressure_listener(server->allocator,
+	                                      &server->allocator_pressure);
 	if (!(server->output_layout = wlr_output_layout_create(server->wl_display)))
 		err(1, "Cannot create scene layout");
 
-	// Check that the process is single threaded before using much from wlroots
-	check_single_threaded();
+	if (async_teardown &&
+	    !qubes_allocator_start_reclaim(
+	       server->allocator, wl_display_get_event_loop(server->wl_display)))
+		warn("Cannot start buffer teardown thread, buffers will be released "
+		     "synchronously");
+
+	const unsigned long render_threads =
+	   render_threads_str
+	      ? strict_strtoul(render_threads_str, "render thread count",
+	                       QUBES_MAX_RENDER_THREADS)
+	      : 0;
+	if (render_threads &&
+	    !(server->render_pool =
+	         qubes_render_pool_create((unsigned int)render_threads)))
+		warn("Cannot start render threads, compositing on the main thread");
+
+	// Check that no unexpected threads are running before using much from
+	// wlroots
+	check_thread_count(1 + qubes_allocator_thread_count(server->allocator) +
+	                   qubes_render_pool_thread_count(server->render_pool));
 
 	wlr_log_init(loglevel, NULL);
 
@@ -757,7 +1057,8 @@ int main(int argc, char *argv[])
 	 * if an X11 server is running. */
 	if (!(server->backend =
 	         qubes_backend_create(server->wl_display, domid, &server->views,
-	                              server->headless_output))) {
+	                              server->headless_output,
+	                              (int32_t)server->refresh_mhz))) {
 		wlr_log(WLR_ERROR, "Cannot create wlr_backend");
 		return 1;
 	}
@@ -804,6 +1105,14 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
+	/* Commits count as presented when the GUI daemon acknowledges their
+	 * dumps, see qubes_output_dump_acked() */
+	if (!wlr_presentation_create(server->wl_display,
+	                             &server->backend->backend)) {
+		wlr_log(WLR_ERROR, "Cannot create presentation time manager");
+		return 1;
+	}
+
 	/* Enable server-side decorations.  By default, Wayland clients decorate
 	 * themselves, but that will lead to duplicate decorations on Qubes OS. */
 	server->old_manager =
@@ -846,6 +1155,8 @@ int main(int argc, char *argv[])
 	 * https://drewdevault.com/2018/07/29/Wayland-shells.html
 	 */
 	wl_list_init(&server->views);
+	wl_list_init(&server->frame_outputs);
+	wl_list_init(&server->render_outputs);
 	if (!(server->xdg_shell = wlr_xdg_shell_create(server->wl_display, 3))) {
 		wlr_log(WLR_ERROR, "Cannot create xdg_shell");
 		return 1;
@@ -911,12 +1222,12 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
-	if (!(server->timer = wl_event_loop_add_timer(
-	         loop, qubes_send_frame_callbacks, server))) {
+	if (!qubes_frame_clock_init(&server->frame_clock, loop,
+	                            server->refresh_mhz, qubes_output_frame_tick,
+	                            server)) {
 		wlr_log(WLR_ERROR, "Cannot create timer");
 		return 1;
 	}
-	wl_event_source_timer_update(server->timer, 16);
 
 	/* Start the backend. This will enumerate outputs and inputs, become the DRM
 	 * master, etc */
@@ -928,9 +1239,13 @@ int main(int argc, char *argv[])
 
 	/* Refresh keyboard layout from qubesdb */
 	qubes_refresh_keyboard_layout(server);
+	/* Unless overridden on the command line */
+	if (!refresh_str)
+		qubes_refresh_refresh_rate(server);
 
 	/*
-	 * Add signal handlers for SIGTERM, SIGINT, and SIGHUP
+	 * Add signal handlers for SIGTERM, SIGINT, and SIGHUP, and for SIGUSR1,
+	 * which dumps buffer statistics to stderr
 	 */
 	struct wl_event_source *sigint =
 	   handle_sigint
@@ -940,7 +1255,9 @@ int main(int argc, char *argv[])
 	   wl_event_loop_add_signal(loop, SIGTERM, qubes_clean_exit, server);
 	struct wl_event_source *sighup =
 	   wl_event_loop_add_signal(loop, SIGHUP, qubes_clean_exit, server);
-	if (!sigterm || (handle_sigint && !sigint) || !sighup) {
+	struct wl_event_source *sigusr1 =
+	   wl_event_loop_add_signal(loop, SIGUSR1, qubes_dump_stats, server);
+	if (!sigterm || (handle_sigint && !sigint) || !sighup || !sigusr1) {
 		// FIXME: reimplement sd_notify from scratch
 #ifdef QUBES_HAS_SYSTEMD
 		sd_notifyf(0, "ERRNO=%d", errno);
@@ -973,11 +1290,14 @@ int main(int argc, char *argv[])
 
 	/* Once wl_display_run returns, we shut down the server */
 	wl_display_destroy_clients(server->wl_display);
+	wl_event_source_remove(sigusr1);
 	wl_event_source_remove(sighup);
 	if (sigint)
 		wl_event_source_remove(sigint);
 	wl_event_source_remove(sigterm);
-	wl_event_source_remove(server->timer);
+	qubes_frame_clock_finish(&server->frame_clock);
+	if (server->render_idle)
+		wl_event_source_remove(server->render_idle);
 	wl_event_source_remove(server->qubesdb_watcher);
 	if (server->xwayland)
 		wlr_xwayland_destroy(server->xwayland);
@@ -990,6 +1310,7 @@ int main(int argc, char *argv[])
 		wl_list_remove(&keyboard_to_free->link);
 	}
 	wlr_renderer_destroy(server->renderer);
+	qubes_render_pool_destroy(server->render_pool);
 	wlr_allocator_destroy(server->allocator);
 	wlr_output_layout_destroy(server->output_layout);
 	wl_display_destroy(server->wl_display);
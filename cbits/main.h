@@ -7,8 +7,12 @@
 
 #include <qubes-gui-protocol.h>
 #include <qubesdb-client.h>
+
+#include "qubes_frame_clock.h"
 void qubes_rust_send_message(void *backend, struct msg_hdr *header);
 void qubes_rust_delete_id(void *backend, uint32_t id);
+void qubes_rust_begin_batch(void *backend);
+void qubes_rust_end_batch(void *backend);
 
 struct wlr_surface;
 struct tinywl_view;
@@ -41,12 +45,19 @@ struct tinywl_server {
 	struct qubes_link *queue_tail;
 	struct wlr_renderer *renderer;
 	struct wlr_allocator *allocator;
+	struct wl_listener allocator_pressure;
 
 	struct wlr_xdg_shell *xdg_shell;
 	struct wl_listener new_xdg_toplevel;
 	struct wl_listener new_xdg_popup;
 	struct wl_listener new_xwayland_surface;
 	struct wl_list views;
+	/* Outputs waiting for the next frame tick, see qubes_output_frame_tick() */
+	struct wl_list frame_outputs;
+	/* Outputs drawing their next frame together, see
+	 * qubes_output_render_batch() */
+	struct wl_list render_outputs;
+	struct wl_event_source *render_idle;
 
 	struct wlr_seat *seat;
 	struct wl_listener new_input;
@@ -64,7 +75,7 @@ struct tinywl_server {
 	struct wlr_server_decoration_manager *old_manager;
 	struct wlr_xdg_decoration_manager_v1 *new_manager;
 	struct wl_listener new_decoration;
-	struct wl_event_source *timer, *qubesdb_watcher;
+	struct wl_event_source *qubesdb_watcher;
 	struct wlr_compositor *compositor;
 	struct wlr_subcompositor *subcompositor;
 	struct wlr_data_device_manager *data_device;
@@ -74,11 +85,29 @@ struct tinywl_server {
 	qdb_handle_t qubesdb_connection;
 	uint32_t magic;
 	uint16_t domid;
-	bool frame_pending, vchan_error;
+	bool vchan_error;
 	uint64_t output_counter;
 	int listening_socket;
 	uint8_t exit_status;
 	bool keymap_errors_fatal;
+	/* How long a window must be hidden before its buffers are released,
+	 * or -1 to never release them */
+	int32_t hidden_reclaim_ms;
+	/* Interval between frame done events for hidden windows, or -1 to send
+	 * none until they are shown again */
+	int32_t hidden_frame_ms;
+	/* Allocate each window's buffers from a single grant region */
+	bool window_arenas;
+	/* Cost of a MSG_SHMIMAGE in pixels, 0 disables damage coalescing */
+	uint32_t damage_message_cost;
+	/* Compare damaged pixels against the previous frame before sending */
+	bool damage_diff;
+	bool zero_copy; /* dump client buffers instead of compositing them */
+	/* Composites large damage in tiles on worker threads, or NULL */
+	struct qubes_render_pool *render_pool;
+	uint32_t refresh_mhz;
+	/* Sends frame events, see qubes_output_frame_tick() */
+	struct qubes_frame_clock frame_clock;
 };
 
 #endif
@@ -1,4 +1,4 @@
-// Allocator backed by Xen shared memory
+// Allocator backed by Xen shared memory (or POSIX shared memory for testing)
 
 #ifdef _GNU_SOURCE
 #undef _GNU_SOURCE
@@ -6,23 +6,44 @@
 #define _POSIX_C_SOURCE 200809L
 #include "common.h"
 #include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <linux/udmabuf.h>
+/* Hidden by _POSIX_C_SOURCE; values from <linux/fcntl.h> */
+#ifndef F_GET_SEALS
+#define F_GET_SEALS 1034
+#endif
+#ifndef F_SEAL_SHRINK
+#define F_SEAL_SHRINK 0x0002
+#endif
+
+#include <wayland-server-core.h>
 #include <wlr/interfaces/wlr_buffer.h>
 #include <wlr/render/allocator.h>
 #include <wlr/render/drm_format_set.h>
 #include <wlr/types/wlr_buffer.h>
+#include <wlr/util/addon.h>
 #include <wlr/util/box.h>
 #include <wlr/util/log.h>
 
 #include <drm_fourcc.h>
 #include <qubes-gui-protocol.h>
 #include <xen/gntalloc.h>
+/* Used but not defined by the kernel's gntdev header */
+typedef uint16_t domid_t;
+typedef uint32_t grant_ref_t;
+#include <xen/gntdev.h>
 
 #include "qubes_allocator.h"
 
@@ -55,19 +76,356 @@ static const struct wlr_buffer_impl qubes_buffer_impl = {
 };
 const struct wlr_buffer_impl *qubes_buffer_impl_addr = &qubes_buffer_impl;
 
+/*
+ * Latency histogram.  Bucket 0 counts operations that took less than 1 us,
+ * bucket i > 0 those that took less than 2^i us, and the last bucket
+ * everything slower.
+ */
+#define QUBES_LATENCY_BUCKETS 24
+struct qubes_latency_histogram {
+	uint64_t count, total_ns, max_ns;
+	uint64_t buckets[QUBES_LATENCY_BUCKETS];
+};
+
+/* Maximum number of buffers being prefetched at once */
+#define QUBES_PREFETCH_MAX 4
+
+struct qubes_prefetch {
+	struct wl_list link;
+	struct qubes_buffer *buffer;
+	int32_t pages;
+	bool mapped;
+	uint64_t alloc_ns, map_ns;
+};
+
 struct qubes_allocator {
 	struct wlr_allocator inner;
 	uint64_t refcount;
 	int xenfd;
 	uint16_t domid;
+	enum qubes_allocator_backend backend;
+	bool destroyed;
+	uint32_t next_fake_gref;
+	/* Buffer pool, most recently used first.  This is small, so a linear
+	 * search is fine. */
+	struct wl_list pool;
+	uint32_t pool_pages, pool_max_pages;
+	uint64_t pool_hits, pool_misses;
+	/* Interactive resize support */
+	uint32_t reserved_pages, size_hint;
+	/*
+	 * Asynchronous teardown, see qubes_allocator_start_reclaim().  The
+	 * worker thread takes buffers from reclaim_queue, unmaps and ungrants
+	 * them, and puts them on reclaim_done for the main thread to free.
+	 * Everything else in this struct is only touched by the main thread.
+	 */
+	pthread_t reclaim_thread;
+	pthread_mutex_t reclaim_lock;
+	pthread_cond_t reclaim_cond;
+	struct wl_list reclaim_queue; /* protected by reclaim_lock */
+	struct wl_list reclaim_done;  /* protected by reclaim_lock */
+	bool reclaim_stop;            /* protected by reclaim_lock */
+	bool reclaim_running;
+	int reclaim_eventfd;
+	struct wl_event_source *reclaim_source;
+	uint32_t reclaim_pages; /* queued or being released */
+	/*
+	 * Buffers granted and prefaulted ahead of time by the same thread, see
+	 * qubes_allocator_prefetch().  Jobs move from prefetch_queue to
+	 * prefetch_done; prefetch_pending holds the sizes of the jobs that have
+	 * not been collected yet.
+	 */
+	struct wl_list prefetch_queue; /* protected by reclaim_lock */
+	struct wl_list prefetch_done;  /* protected by reclaim_lock */
+	uint32_t prefetch_pending[QUBES_PREFETCH_MAX];
+	unsigned int prefetch_count;
+	uint64_t prefetched, prefetch_used, prefetch_late;
+	/* Time the event loop spent releasing buffers, and time until their
+	 * pages were back in the budget */
+	struct qubes_latency_histogram teardown, release_latency;
+	/* Telemetry, see qubes_allocator_dump_stats() */
+	struct qubes_latency_histogram alloc_latency, map_latency;
+	struct qubes_latency_histogram dealloc_latency; /* protected by reclaim_lock
+	                                                   if reclaim_running */
+	uint32_t live_buffers, live_buffers_peak;
+	uint32_t live_pages, live_pages_peak;
+	uint64_t live_bytes, live_bytes_peak;
+	/* Grant page budget, see qubes_allocator_set_grant_limit() */
+	struct wl_signal pressure;
+	uint32_t grant_limit; /* 0 means no limit is known */
+	uint32_t granted_pages, granted_peak;
+	uint64_t budget_refusals;
+	bool budget_exhausted;
+	/* Arena of the window being rendered, see qubes_allocator_set_arena() */
+	struct qubes_arena *arena;
+	/* Zero-copy client buffers, see qubes_allocator_import() */
+	bool import_enabled;
+	int udmabuf_fd, gntdev_fd; /* -1 with the shared memory backend */
+	uint32_t imported_buffers, imported_pages;
+	uint64_t imports, imports_refused, imports_unsealed;
+};
+
+/*
+ * Attached to a client buffer that qubes_allocator_import() has seen, so
+ * that it is only imported once.  The imported buffer outlives the client
+ * buffer if the GUI daemon has not acknowledged its last dump yet.
+ */
+struct qubes_import {
+	struct wlr_addon addon;
+	struct wlr_buffer *source;
+	struct qubes_buffer *buffer; /* NULL if the client buffer was refused */
+};
+
+/* Number of slots in each arena region */
+#define QUBES_ARENA_SLOTS 3
+
+/*
+ * A single grant region carved into equally sized slots.  It is referenced
+ * by the arena that allocates from it (if any) and by each buffer in a slot.
+ */
+struct qubes_arena_region {
+	struct qubes_allocator *alloc;
+	struct qubes_buffer *backing; /* owns the mapping and grant references */
+	uint32_t refcount;
+	uint32_t slot_pages;
+	uint32_t used_slots; /* bitmask */
 };
 
+struct qubes_arena {
+	struct qubes_allocator *alloc;
+	struct qubes_arena_region *current;
+};
+
+static void qubes_buffer_release_grant(struct qubes_allocator *qalloc,
+                                       struct qubes_buffer *buffer);
+static void qubes_buffer_init(struct qubes_allocator *qalloc,
+                              struct qubes_buffer *buffer, int width,
+                              int height, uint32_t format);
+static void qubes_buffer_release_import(struct qubes_allocator *qalloc,
+                                        struct qubes_buffer *buffer);
+
+static uint64_t qubes_monotonic_ns(void)
+{
+	struct timespec now;
+	assert(clock_gettime(CLOCK_MONOTONIC, &now) == 0);
+	return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+
+/* The grant reference array directly follows the window dump header */
+static uint32_t *qubes_buffer_grefs(struct qubes_buffer *buffer)
+{
+	return (uint32_t *)((char *)buffer + offsetof(struct qubes_buffer, qubes) +
+	                    sizeof(buffer->qubes));
+}
+
+static struct qubes_buffer *qubes_buffer_alloc(int32_t pages)
+{
+	struct qubes_buffer *buffer =
+	   calloc((size_t)pages * SIZEOF_GRANT_REF +
+	             offsetof(struct qubes_buffer, qubes) + sizeof(buffer->qubes),
+	          1);
+	if (!buffer)
+		wlr_log(WLR_ERROR, "calloc(3) failed");
+	return buffer;
+}
+
+static void qubes_latency_record(struct qubes_latency_histogram *histogram,
+                                 uint64_t ns)
+{
+	const uint64_t us = ns / 1000;
+	unsigned int bucket = us ? 64 - (unsigned int)__builtin_clzll(us) : 0;
+	if (bucket >= QUBES_LATENCY_BUCKETS)
+		bucket = QUBES_LATENCY_BUCKETS - 1;
+	histogram->buckets[bucket]++;
+	histogram->count++;
+	histogram->total_ns += ns;
+	if (ns > histogram->max_ns)
+		histogram->max_ns = ns;
+}
+
+static void qubes_latency_dump(FILE *out, const char *name,
+                               const struct qubes_latency_histogram *histogram)
+{
+	fprintf(out, "  %s: %" PRIu64 " operations", name, histogram->count);
+	if (histogram->count == 0) {
+		fputc('\n', out);
+		return;
+	}
+	fprintf(out, ", %" PRIu64 " us average, %" PRIu64 " us worst case\n",
+	        histogram->total_ns / histogram->count / 1000,
+	        histogram->max_ns / 1000);
+	for (unsigned int i = 0; i < QUBES_LATENCY_BUCKETS; ++i) {
+		if (histogram->buckets[i] == 0)
+			continue;
+		if (i == QUBES_LATENCY_BUCKETS - 1)
+			fprintf(out, "    >= %10" PRIu64 " us: %" PRIu64 "\n",
+			        UINT64_C(1) << (i - 1), histogram->buckets[i]);
+		else
+			fprintf(out, "    <  %10" PRIu64 " us: %" PRIu64 "\n",
+			        UINT64_C(1) << i, histogram->buckets[i]);
+	}
+}
+
+static void qubes_buffer_pool_remove(struct qubes_allocator *qalloc,
+                                     struct qubes_buffer *buffer)
+{
+	assert(qalloc->pool_pages >= buffer->pages);
+	qalloc->pool_pages -= buffer->pages;
+	wl_list_remove(&buffer->link);
+}
+
+/*
+ * The pool may exceed its configured size by twice the reserved size, which
+ * is enough for the buffers of one swapchain to be recycled into the next.
+ */
+static uint32_t qubes_buffer_pool_limit(struct qubes_allocator *qalloc)
+{
+	uint64_t limit =
+	   (uint64_t)qalloc->pool_max_pages + 2 * (uint64_t)qalloc->reserved_pages;
+	return limit > UINT32_MAX ? UINT32_MAX : (uint32_t)limit;
+}
+
+/* Evict least recently used buffers until at most max_pages are pooled */
+static void qubes_buffer_pool_trim(struct qubes_allocator *qalloc,
+                                   uint32_t max_pages)
+{
+	while (qalloc->pool_pages > max_pages) {
+		assert(!wl_list_empty(&qalloc->pool));
+		struct qubes_buffer *victim =
+		   wl_container_of(qalloc->pool.prev, victim, link);
+		qubes_buffer_pool_remove(qalloc, victim);
+		qubes_buffer_release_grant(qalloc, victim);
+	}
+}
+
+/* Takes the most recently used buffer with between min and max pages */
+static struct qubes_buffer *qubes_buffer_pool_take(struct qubes_allocator *qalloc,
+                                                   uint32_t min, uint32_t max)
+{
+	struct qubes_buffer *buffer;
+	wl_list_for_each (buffer, &qalloc->pool, link) {
+		if (buffer->pages >= min && buffer->pages <= max) {
+			qubes_buffer_pool_remove(qalloc, buffer);
+			if (buffer->prefetched) {
+				buffer->prefetched = false;
+				qalloc->prefetch_used++;
+			}
+			return buffer;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Above this many granted pages, freed buffers are not pooled and
+ * allocations try to free up reclaimable pages first.
+ */
+static uint32_t qubes_budget_high_water(struct qubes_allocator *qalloc)
+{
+	return qalloc->grant_limit - qalloc->grant_limit / 8;
+}
+
+static bool qubes_budget_under_pressure(struct qubes_allocator *qalloc)
+{
+	return qalloc->grant_limit &&
+	       qalloc->granted_pages > qubes_budget_high_water(qalloc);
+}
+
+static bool qubes_buffer_pool_put(struct qubes_allocator *qalloc,
+                                  struct qubes_buffer *buffer)
+{
+	const uint32_t limit = qubes_buffer_pool_limit(qalloc);
+	if (qalloc->destroyed || buffer->pages > limit ||
+	    qubes_budget_under_pressure(qalloc))
+		return false;
+	wl_list_insert(&qalloc->pool, &buffer->link);
+	qalloc->pool_pages += buffer->pages;
+	qubes_buffer_pool_trim(qalloc, limit);
+	return true;
+}
+
+void qubes_allocator_set_pool_limit(struct wlr_allocator *alloc,
+                                    uint32_t max_pages)
+{
+	assert(alloc->impl == &qubes_allocator_impl);
+	struct qubes_allocator *qalloc = wl_container_of(alloc, qalloc, inner);
+	qalloc->pool_max_pages = max_pages;
+	qubes_buffer_pool_trim(qalloc, qubes_buffer_pool_limit(qalloc));
+}
+
+void qubes_allocator_begin_reserve(struct wlr_allocator *alloc, uint32_t pages)
+{
+	assert(alloc->impl == &qubes_allocator_impl);
+	struct qubes_allocator *qalloc = wl_container_of(alloc, qalloc, inner);
+	assert(qalloc->reserved_pages <= UINT32_MAX - pages);
+	qalloc->reserved_pages += pages;
+}
+
+void qubes_allocator_end_reserve(struct wlr_allocator *alloc, uint32_t pages)
+{
+	assert(alloc->impl == &qubes_allocator_impl);
+	struct qubes_allocator *qalloc = wl_container_of(alloc, qalloc, inner);
+	assert(qalloc->reserved_pages >= pages);
+	qalloc->reserved_pages -= pages;
+	qubes_buffer_pool_trim(qalloc, qubes_buffer_pool_limit(qalloc));
+}
+
+void qubes_allocator_set_size_hint(struct wlr_allocator *alloc,
+                                   uint32_t pages)
+{
+	assert(alloc->impl == &qubes_allocator_impl);
+	struct qubes_allocator *qalloc = wl_container_of(alloc, qalloc, inner);
+	qalloc->size_hint = pages;
+}
+
+void qubes_allocator_set_grant_limit(struct wlr_allocator *alloc,
+                                     uint32_t pages)
+{
+	assert(alloc->impl == &qubes_allocator_impl);
+	struct qubes_allocator *qalloc = wl_container_of(alloc, qalloc, inner);
+	if (qalloc->backend != QUBES_ALLOCATOR_GNTALLOC)
+		return;
+	wlr_log(WLR_INFO, "Grant page budget: %" PRIu32 " pages", pages);
+	qalloc->grant_limit = pages;
+}
+
+void qubes_allocator_add_pressure_listener(struct wlr_allocator *alloc,
+                                           struct wl_listener *listener)
+{
+	assert(alloc->impl == &qubes_allocator_impl);
+	struct qubes_allocator *qalloc = wl_container_of(alloc, qalloc, inner);
+	wl_signal_add(&qalloc->pressure, listener);
+}
+
+static void qubes_allocator_stop_reclaim(struct qubes_allocator *qalloc);
+
 static void qubes_allocator_destroy(struct wlr_allocator *allocator)
 {
 	struct qubes_allocator *qubes = wl_container_of(allocator, qubes, inner);
-	assert(close(qubes->xenfd) == 0 &&
-	       "Closing a gntalloc handle always succeeds");
-	qubes->xenfd = -1;
+	wlr_log(WLR_INFO, "Buffer pool: %" PRIu64 " hits, %" PRIu64 " misses",
+	        qubes->pool_hits, qubes->pool_misses);
+	wlr_log(WLR_INFO,
+	        "Grant pages: peak %" PRIu32 " of %" PRIu32
+	        ", %" PRIu64 " allocations refused",
+	        qubes->granted_peak, qubes->grant_limit, qubes->budget_refusals);
+	qubes_buffer_pool_trim(qubes, 0);
+	if (qubes->teardown.count) {
+		wlr_log(WLR_INFO,
+		        "Buffer teardown (%s): %" PRIu64 " buffers blocked the event "
+		        "loop for %" PRIu64 " us total, %" PRIu64 " us average, %" PRIu64
+		        " us worst case",
+		        qubes->reclaim_running ? "asynchronous" : "synchronous",
+		        qubes->teardown.count, qubes->teardown.total_ns / 1000,
+		        qubes->teardown.total_ns / qubes->teardown.count / 1000,
+		        qubes->teardown.max_ns / 1000);
+	}
+	qubes_allocator_stop_reclaim(qubes);
+	if (qubes->xenfd != -1) {
+		assert(close(qubes->xenfd) == 0 &&
+		       "Closing a gntalloc handle always succeeds");
+		qubes->xenfd = -1;
+	}
+	qubes->destroyed = true;
 	qubes_allocator_decref(qubes);
 }
 
@@ -76,32 +434,63 @@ static void qubes_allocator_decref(struct qubes_allocator *allocator)
 	assert(allocator->refcount > 0 && "use after free???");
 	allocator->refcount--;
 	if (allocator->refcount == 0) {
-		assert(allocator->xenfd == -1 &&
+		assert(allocator->destroyed && allocator->xenfd == -1 &&
 		       "Xen FD wasn’t closed by qubes_allocator_destroy?");
+		/* Kept open until the last imported buffer has been released */
+		if (allocator->udmabuf_fd != -1)
+			assert(close(allocator->udmabuf_fd) == 0);
+		if (allocator->gntdev_fd != -1)
+			assert(close(allocator->gntdev_fd) == 0);
 		free(allocator);
 	}
 }
 
-struct wlr_allocator *qubes_allocator_create(uint16_t domid)
+/* Enough for a couple of 1080p windows */
+#define QUBES_DEFAULT_POOL_PAGES 4096
+
+struct wlr_allocator *
+qubes_allocator_create(uint16_t domid, enum qubes_allocator_backend backend)
 {
 	struct qubes_allocator *qubes = calloc(1, sizeof(*qubes));
 	if (!qubes)
 		return NULL;
 	qubes->domid = domid;
-	if ((qubes->xenfd =
-	        open("/dev/xen/gntalloc", O_RDWR | O_CLOEXEC | O_NOCTTY)) < 0) {
-		int err = errno;
-		assert(qubes->xenfd == -1);
-		free(qubes);
-		errno = err;
-		return NULL;
-	} else {
+	qubes->backend = backend;
+	qubes->xenfd = -1;
+	if (backend == QUBES_ALLOCATOR_GNTALLOC) {
+		if ((qubes->xenfd = open("/dev/xen/gntalloc",
+		                         O_RDWR | O_CLOEXEC | O_NOCTTY)) < 0) {
+			int err = errno;
+			assert(qubes->xenfd == -1);
+			free(qubes);
+			errno = err;
+			return NULL;
+		}
 		assert(qubes->xenfd > 2 && "FD 0, 1, or 2 got closed earlier?");
-		qubes->refcount = 1;
-		wlr_allocator_init(&qubes->inner, &qubes_allocator_impl,
-		                   WLR_BUFFER_CAP_DATA_PTR);
-		return &qubes->inner;
+	} else {
+		assert(backend == QUBES_ALLOCATOR_SHM);
+		wlr_log(WLR_INFO, "Using shared memory allocator: buffers cannot be "
+		                  "displayed by the GUI daemon");
+		/* Grant references below 8 are reserved */
+		qubes->next_fake_gref = 8;
 	}
+	qubes->refcount = 1;
+	qubes->reclaim_eventfd = -1;
+	qubes->udmabuf_fd = qubes->gntdev_fd = -1;
+	wl_list_init(&qubes->pool);
+	wl_signal_init(&qubes->pressure);
+	qubes->pool_max_pages = QUBES_DEFAULT_POOL_PAGES;
+	wlr_allocator_init(&qubes->inner, &qubes_allocator_impl,
+	                   WLR_BUFFER_CAP_DATA_PTR);
+	return &qubes->inner;
+}
+
+bool qubes_allocator_has_grants(struct wlr_allocator *alloc)
+{
+	assert(alloc->impl == &qubes_allocator_impl);
+	struct qubes_allocator *qalloc = wl_container_of(alloc, qalloc, inner);
+
+	return qalloc->backend == QUBES_ALLOCATOR_GNTALLOC;
 }
 #ifndef XC_PAGE_SIZE
 #define XC_PAGE_SIZE 4096
@@ -120,6 +509,687 @@ static void report_gntalloc_error(void)
 	}
 }
 
+static void qubes_budget_charge(struct qubes_allocator *qalloc, uint32_t pages)
+{
+	assert(qalloc->granted_pages <= UINT32_MAX - pages);
+	qalloc->granted_pages += pages;
+	if (qalloc->granted_pages > qalloc->granted_peak)
+		qalloc->granted_peak = qalloc->granted_pages;
+}
+
+static void qubes_budget_credit(struct qubes_allocator *qalloc, uint32_t pages)
+{
+	assert(qalloc->granted_pages >= pages);
+	qalloc->granted_pages -= pages;
+}
+
+/*
+ * Stand-in for qubes_buffer_map() that uses POSIX shared memory.  The grant
+ * references are made up by qubes_buffer_grant(), but the buffer layout is
+ * otherwise identical, so everything downstream of the allocator works
+ * unchanged.
+ */
+static bool qubes_buffer_map_shm(struct qubes_buffer *buffer, int32_t pages,
+                                 uint64_t *alloc_ns, uint64_t *map_ns)
+{
+	char name[64];
+	int fd;
+	static uint64_t counter;
+
+	uint64_t start = qubes_monotonic_ns();
+	do {
+		snprintf(name, sizeof name, "/qubes-compositor-%ld-%" PRIu64,
+		         (long)getpid(), __atomic_fetch_add(&counter, 1, __ATOMIC_RELAXED));
+		fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	} while (fd == -1 && errno == EEXIST);
+	if (fd == -1) {
+		wlr_log(WLR_ERROR, "shm_open(%s) failed: %s", name, strerror(errno));
+		return false;
+	}
+	assert(shm_unlink(name) == 0);
+	if (ftruncate(fd, (off_t)pages * XC_PAGE_SIZE) != 0) {
+		wlr_log(WLR_ERROR, "ftruncate() failed: %s", strerror(errno));
+		assert(close(fd) == 0);
+		return false;
+	}
+	*alloc_ns = qubes_monotonic_ns() - start;
+	start = qubes_monotonic_ns();
+	buffer->ptr = mmap(NULL, (size_t)pages * XC_PAGE_SIZE,
+	                   PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	*map_ns = qubes_monotonic_ns() - start;
+	assert(close(fd) == 0);
+	if (buffer->ptr == MAP_FAILED) {
+		wlr_log(WLR_ERROR, "mmap() failed: %s", strerror(errno));
+		return false;
+	}
+	buffer->index = 0;
+	buffer->pages = (uint32_t)pages;
+	return true;
+}
+
+/*
+ * Allocates grant pages and maps them.  The grant references are written
+ * directly after the window dump header, so that the buffer can be sent as a
+ * MSG_WINDOW_DUMP without copying.  This only reads the immutable parts of
+ * qalloc, so it can run on the reclaim thread.  The time spent allocating and
+ * mapping is stored in *alloc_ns and *map_ns, which are left alone if that
+ * step was not reached.
+ */
+static bool qubes_buffer_map(struct qubes_allocator *qalloc,
+                             struct qubes_buffer *buffer, int32_t pages,
+                             uint64_t *alloc_ns, uint64_t *map_ns)
+{
+	if (qalloc->backend == QUBES_ALLOCATOR_SHM)
+		return qubes_buffer_map_shm(buffer, pages, alloc_ns, map_ns);
+	buffer->xen.domid = qalloc->domid;
+	buffer->xen.flags = GNTALLOC_FLAG_WRITABLE;
+	buffer->xen.count = pages;
+	uint64_t start = qubes_monotonic_ns();
+	int res = ioctl(qalloc->xenfd, IOCTL_GNTALLOC_ALLOC_GREF, &buffer->xen);
+	*alloc_ns = qubes_monotonic_ns() - start;
+	if (res) {
+		assert(res == -1);
+		report_gntalloc_error();
+		return false;
+	}
+	buffer->index = buffer->xen.index;
+	buffer->pages = (uint32_t)pages;
+	start = qubes_monotonic_ns();
+	buffer->ptr = mmap(NULL, (size_t)pages * XC_PAGE_SIZE,
+	                   PROT_READ | PROT_WRITE, MAP_SHARED, qalloc->xenfd,
+	                   (off_t)buffer->index);
+	*map_ns = qubes_monotonic_ns() - start;
+	if (buffer->ptr == MAP_FAILED) {
+		struct ioctl_gntalloc_dealloc_gref dealloc = {
+			.index = buffer->index,
+			.count = pages,
+		};
+		assert(ioctl(qalloc->xenfd, IOCTL_GNTALLOC_DEALLOC_GREF, &dealloc) == 0);
+		return false;
+	}
+	return true;
+}
+
+/* Makes up grant references for the shared memory backend */
+static void qubes_buffer_fake_grefs(struct qubes_allocator *qalloc,
+                                    struct qubes_buffer *buffer)
+{
+	uint32_t *grefs = qubes_buffer_grefs(buffer);
+	for (uint32_t i = 0; i < buffer->pages; ++i) {
+		if (qalloc->next_fake_gref < 8)
+			qalloc->next_fake_gref = 8;
+		grefs[i] = qalloc->next_fake_gref++;
+	}
+}
+
+/* Accounts for a buffer that qubes_buffer_map() has just mapped */
+static void qubes_buffer_mapped(struct qubes_allocator *qalloc,
+                                struct qubes_buffer *buffer, uint64_t alloc_ns,
+                                uint64_t map_ns)
+{
+	qubes_latency_record(&qalloc->alloc_latency, alloc_ns);
+	qubes_latency_record(&qalloc->map_latency, map_ns);
+	if (qalloc->backend == QUBES_ALLOCATOR_SHM)
+		qubes_buffer_fake_grefs(qalloc, buffer);
+}
+
+static struct qubes_buffer *qubes_buffer_grant(struct qubes_allocator *qalloc,
+                                               int32_t pages)
+{
+	uint64_t alloc_ns = 0, map_ns = 0;
+	struct qubes_buffer *buffer = qubes_buffer_alloc(pages);
+	if (!buffer)
+		return NULL;
+	if (!qubes_buffer_map(qalloc, buffer, pages, &alloc_ns, &map_ns)) {
+		if (alloc_ns)
+			qubes_latency_record(&qalloc->alloc_latency, alloc_ns);
+		if (map_ns)
+			qubes_latency_record(&qalloc->map_latency, map_ns);
+		free(buffer);
+		return NULL;
+	}
+	qubes_buffer_mapped(qalloc, buffer, alloc_ns, map_ns);
+	qubes_budget_charge(qalloc, buffer->pages);
+	return buffer;
+}
+
+/*
+ * Writes to every page of a freshly mapped buffer, so that the first render
+ * into it does not take a page fault per page.  The contents are garbage
+ * anyway.
+ */
+static void qubes_buffer_prefault(struct qubes_buffer *buffer)
+{
+	volatile char *const ptr = buffer->ptr;
+	for (size_t i = 0; i < buffer->pages; ++i)
+		ptr[i * XC_PAGE_SIZE] = 0;
+}
+
+/*
+ * Unmaps and ungrants a buffer.  For large buffers this takes a long time, as
+ * the kernel must tear down the page tables and the grant table entries, so
+ * this runs on the reclaim thread if there is one.  It must not touch anything
+ * in qalloc other than xenfd.  Returns the time taken.
+ */
+static uint64_t qubes_buffer_unmap(struct qubes_allocator *qalloc,
+                                   struct qubes_buffer *buffer)
+{
+	struct ioctl_gntalloc_dealloc_gref dealloc = {
+		.index = buffer->index,
+		.count = buffer->pages,
+	};
+	const uint64_t start = qubes_monotonic_ns();
+	assert(munmap(buffer->ptr, (size_t)buffer->pages * XC_PAGE_SIZE) == 0);
+	if (qalloc->xenfd != -1)
+		assert(ioctl(qalloc->xenfd, IOCTL_GNTALLOC_DEALLOC_GREF, &dealloc) == 0);
+	return qubes_monotonic_ns() - start;
+}
+
+static void qubes_buffer_release_grant(struct qubes_allocator *qalloc,
+                                       struct qubes_buffer *buffer)
+{
+	const uint64_t start = qubes_monotonic_ns();
+	if (qalloc->reclaim_running) {
+		buffer->release_ns = start;
+		qalloc->reclaim_pages += buffer->pages;
+		assert(pthread_mutex_lock(&qalloc->reclaim_lock) == 0);
+		wl_list_insert(&qalloc->reclaim_queue, &buffer->link);
+		assert(pthread_cond_signal(&qalloc->reclaim_cond) == 0);
+		assert(pthread_mutex_unlock(&qalloc->reclaim_lock) == 0);
+	} else {
+		qubes_latency_record(&qalloc->dealloc_latency,
+		                     qubes_buffer_unmap(qalloc, buffer));
+		qubes_budget_credit(qalloc, buffer->pages);
+		free(buffer);
+	}
+	const uint64_t elapsed = qubes_monotonic_ns() - start;
+	qubes_latency_record(&qalloc->teardown, elapsed);
+	if (!qalloc->reclaim_running)
+		qubes_latency_record(&qalloc->release_latency, elapsed);
+}
+
+static void *qubes_reclaim_worker(void *data)
+{
+	struct qubes_allocator *qalloc = data;
+	const uint64_t one = 1;
+
+	assert(pthread_mutex_lock(&qalloc->reclaim_lock) == 0);
+	for (;;) {
+		while (wl_list_empty(&qalloc->reclaim_queue) &&
+		       wl_list_empty(&qalloc->prefetch_queue) && !qalloc->reclaim_stop)
+			assert(pthread_cond_wait(&qalloc->reclaim_cond,
+			                         &qalloc->reclaim_lock) == 0);
+		/* Releases go first, as they free up budget */
+		if (!wl_list_empty(&qalloc->reclaim_queue)) {
+			struct qubes_buffer *buffer =
+			   wl_container_of(qalloc->reclaim_queue.prev, buffer, link);
+			wl_list_remove(&buffer->link);
+			assert(pthread_mutex_unlock(&qalloc->reclaim_lock) == 0);
+			const uint64_t elapsed = qubes_buffer_unmap(qalloc, buffer);
+			assert(pthread_mutex_lock(&qalloc->reclaim_lock) == 0);
+			qubes_latency_record(&qalloc->dealloc_latency, elapsed);
+			wl_list_insert(&qalloc->reclaim_done, &buffer->link);
+		} else if (qalloc->reclaim_stop) {
+			/* Drain the release queue before stopping, but drop prefetches */
+			wl_list_insert_list(&qalloc->prefetch_done, &qalloc->prefetch_queue);
+			wl_list_init(&qalloc->prefetch_queue);
+			break;
+		} else {
+			struct qubes_prefetch *job =
+			   wl_container_of(qalloc->prefetch_queue.prev, job, link);
+			wl_list_remove(&job->link);
+			assert(pthread_mutex_unlock(&qalloc->reclaim_lock) == 0);
+			job->mapped = qubes_buffer_map(qalloc, job->buffer, job->pages,
+			                               &job->alloc_ns, &job->map_ns);
+			if (job->mapped)
+				qubes_buffer_prefault(job->buffer);
+			assert(pthread_mutex_lock(&qalloc->reclaim_lock) == 0);
+			wl_list_insert(&qalloc->prefetch_done, &job->link);
+		}
+		assert(write(qalloc->reclaim_eventfd, &one, sizeof one) == sizeof one);
+	}
+	assert(pthread_mutex_unlock(&qalloc->reclaim_lock) == 0);
+	return NULL;
+}
+
+static void qubes_prefetch_forget(struct qubes_allocator *qalloc,
+                                  uint32_t pages)
+{
+	for (unsigned int i = 0; i < qalloc->prefetch_count; ++i) {
+		if (qalloc->prefetch_pending[i] == pages) {
+			qalloc->prefetch_pending[i] =
+			   qalloc->prefetch_pending[--qalloc->prefetch_count];
+			return;
+		}
+	}
+	assert(!"prefetch job not pending");
+}
+
+/*
+ * Frees buffers that the reclaim thread has finished with, and pools the
+ * buffers it has prefetched.
+ */
+static void qubes_reclaim_collect(struct qubes_allocator *qalloc)
+{
+	struct wl_list done, prefetched;
+	struct qubes_buffer *buffer, *tmp;
+	struct qubes_prefetch *job, *tmp_job;
+
+	wl_list_init(&done);
+	wl_list_init(&prefetched);
+	assert(pthread_mutex_lock(&qalloc->reclaim_lock) == 0);
+	wl_list_insert_list(&done, &qalloc->reclaim_done);
+	wl_list_init(&qalloc->reclaim_done);
+	wl_list_insert_list(&prefetched, &qalloc->prefetch_done);
+	wl_list_init(&qalloc->prefetch_done);
+	assert(pthread_mutex_unlock(&qalloc->reclaim_lock) == 0);
+	const uint64_t now = qubes_monotonic_ns();
+	wl_list_for_each_safe (buffer, tmp, &done, link) {
+		qubes_latency_record(&qalloc->release_latency, now - buffer->release_ns);
+		assert(qalloc->reclaim_pages >= buffer->pages);
+		qalloc->reclaim_pages -= buffer->pages;
+		qubes_budget_credit(qalloc, buffer->pages);
+		wl_list_remove(&buffer->link);
+		free(buffer);
+	}
+	wl_list_for_each_safe (job, tmp_job, &prefetched, link) {
+		wl_list_remove(&job->link);
+		qubes_prefetch_forget(qalloc, (uint32_t)job->pages);
+		if (!job->mapped) {
+			/* failed or dropped; the pages were charged when it was queued */
+			qubes_budget_credit(qalloc, (uint32_t)job->pages);
+			free(job->buffer);
+		} else {
+			qubes_buffer_mapped(qalloc, job->buffer, job->alloc_ns, job->map_ns);
+			job->buffer->prefetched = true;
+			qalloc->prefetched++;
+			/* While stopping, the pool has already been emptied */
+			if (!qalloc->reclaim_running ||
+			    !qubes_buffer_pool_put(qalloc, job->buffer))
+				qubes_buffer_release_grant(qalloc, job->buffer);
+		}
+		free(job);
+	}
+}
+
+static int qubes_reclaim_readable(int fd, uint32_t mask, void *data)
+{
+	uint64_t count;
+	ssize_t res = read(fd, &count, sizeof count);
+	assert(res == sizeof count || (res == -1 && errno == EAGAIN));
+	qubes_reclaim_collect(data);
+	return 0;
+}
+
+bool qubes_allocator_start_reclaim(struct wlr_allocator *alloc,
+                                   struct wl_event_loop *loop)
+{
+	assert(alloc->impl == &qubes_allocator_impl);
+	struct qubes_allocator *qalloc = wl_container_of(alloc, qalloc, inner);
+	sigset_t all_signals, old_mask;
+	int err;
+
+	assert(!qalloc->reclaim_running && qalloc->reclaim_eventfd == -1);
+	if ((qalloc->reclaim_eventfd =
+	        eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == -1)
+		return false;
+	if (!(qalloc->reclaim_source = wl_event_loop_add_fd(
+	         loop, qalloc->reclaim_eventfd, WL_EVENT_READABLE,
+	         qubes_reclaim_readable, qalloc))) {
+		err = errno;
+		goto fail_eventfd;
+	}
+	if ((err = pthread_mutex_init(&qalloc->reclaim_lock, NULL)))
+		goto fail_source;
+	if ((err = pthread_cond_init(&qalloc->reclaim_cond, NULL)))
+		goto fail_mutex;
+	wl_list_init(&qalloc->reclaim_queue);
+	wl_list_init(&qalloc->reclaim_done);
+	wl_list_init(&qalloc->prefetch_queue);
+	wl_list_init(&qalloc->prefetch_done);
+	qalloc->reclaim_stop = false;
+
+	/*
+	 * The main thread receives signals via signalfd, which only works if
+	 * every thread has them blocked.  The worker inherits this mask.
+	 */
+	assert(sigfillset(&all_signals) == 0);
+	assert(pthread_sigmask(SIG_SETMASK, &all_signals, &old_mask) == 0);
+	err = pthread_create(&qalloc->reclaim_thread, NULL, qubes_reclaim_worker,
+	                     qalloc);
+	assert(pthread_sigmask(SIG_SETMASK, &old_mask, NULL) == 0);
+	if (err)
+		goto fail_cond;
+	qalloc->reclaim_running = true;
+	return true;
+fail_cond:
+	assert(pthread_cond_destroy(&qalloc->reclaim_cond) == 0);
+fail_mutex:
+	assert(pthread_mutex_destroy(&qalloc->reclaim_lock) == 0);
+fail_source:
+	wl_event_source_remove(qalloc->reclaim_source);
+	qalloc->reclaim_source = NULL;
+fail_eventfd:
+	assert(close(qalloc->reclaim_eventfd) == 0);
+	qalloc->reclaim_eventfd = -1;
+	errno = err;
+	return false;
+}
+
+unsigned int qubes_allocator_thread_count(struct wlr_allocator *alloc)
+{
+	assert(alloc->impl == &qubes_allocator_impl);
+	struct qubes_allocator *qalloc = wl_container_of(alloc, qalloc, inner);
+	return qalloc->reclaim_running ? 1 : 0;
+}
+
+/*
+ * Waits for the reclaim thread to release everything queued and then stops
+ * it.  Buffers destroyed later are released synchronously.
+ */
+static void qubes_allocator_stop_reclaim(struct qubes_allocator *qalloc)
+{
+	if (!qalloc->reclaim_running)
+		return;
+	assert(pthread_mutex_lock(&qalloc->reclaim_lock) == 0);
+	qalloc->reclaim_stop = true;
+	assert(pthread_cond_signal(&qalloc->reclaim_cond) == 0);
+	assert(pthread_mutex_unlock(&qalloc->reclaim_lock) == 0);
+	assert(pthread_join(qalloc->reclaim_thread, NULL) == 0);
+	qalloc->reclaim_running = false;
+	qubes_reclaim_collect(qalloc);
+	assert(qalloc->reclaim_pages == 0 && qalloc->prefetch_count == 0);
+	wl_event_source_remove(qalloc->reclaim_source);
+	qalloc->reclaim_source = NULL;
+	assert(close(qalloc->reclaim_eventfd) == 0);
+	qalloc->reclaim_eventfd = -1;
+	assert(pthread_cond_destroy(&qalloc->reclaim_cond) == 0);
+	assert(pthread_mutex_destroy(&qalloc->reclaim_lock) == 0);
+}
+
+/*
+ * Makes room for a grant of the given number of pages.  Pooled buffers are
+ * evicted first, then the rest of the compositor is asked to drop buffers it
+ * can do without.  Buffers that the reclaim thread is still releasing are not
+ * waited for, as that would stall the event loop: the allocation fails, and
+ * the frame that needed it is retried at the next frame tick.
+ */
+static bool qubes_budget_make_room(struct qubes_allocator *qalloc,
+                                   uint32_t pages)
+{
+	if (qalloc->grant_limit == 0)
+		return true;
+	if (pages > qalloc->grant_limit)
+		return false;
+	const uint64_t high_water = qubes_budget_high_water(qalloc);
+	uint64_t wanted = (uint64_t)qalloc->granted_pages + pages;
+	if (wanted > high_water) {
+		const uint64_t excess = wanted - high_water;
+		qubes_buffer_pool_trim(qalloc, qalloc->pool_pages > excess
+		                                  ? qalloc->pool_pages - (uint32_t)excess
+		                                  : 0);
+		/* Pages given to the reclaim thread are still granted */
+		wanted = (uint64_t)qalloc->granted_pages - qalloc->reclaim_pages + pages;
+	}
+	if (wanted > high_water) {
+		struct qubes_allocator_pressure_event event = {
+			.pages = (uint32_t)(wanted - high_water),
+		};
+		wl_signal_emit(&qalloc->pressure, &event);
+	}
+	return (uint64_t)qalloc->granted_pages + pages <= qalloc->grant_limit;
+}
+
+/*
+ * Grants a buffer of the given size if the budget allows, logging once each
+ * time the budget runs out rather than on every failed allocation.
+ */
+static struct qubes_buffer *
+qubes_buffer_grant_budgeted(struct qubes_allocator *qalloc, int32_t pages,
+                            int32_t min_pages)
+{
+	if (!qubes_budget_make_room(qalloc, (uint32_t)pages)) {
+		if (pages == min_pages ||
+		    !qubes_budget_make_room(qalloc, (uint32_t)min_pages)) {
+			qalloc->budget_refusals++;
+			if (!qalloc->budget_exhausted)
+				wlr_log(WLR_ERROR,
+				        "Grant page budget exhausted: %" PRIu32
+				        " of %" PRIu32 " pages in use, refusing to allocate "
+				        "%" PRId32 " more",
+				        qalloc->granted_pages, qalloc->grant_limit, min_pages);
+			qalloc->budget_exhausted = true;
+			return NULL;
+		}
+		pages = min_pages;
+	}
+	struct qubes_buffer *buffer = qubes_buffer_grant(qalloc, pages);
+	if (buffer && qalloc->budget_exhausted) {
+		wlr_log(WLR_INFO, "Grant page budget available again");
+		qalloc->budget_exhausted = false;
+	}
+	return buffer;
+}
+
+static bool qubes_prefetch_is_pending(struct qubes_allocator *qalloc,
+                                      uint32_t min, uint32_t max)
+{
+	for (unsigned int i = 0; i < qalloc->prefetch_count; ++i)
+		if (qalloc->prefetch_pending[i] >= min &&
+		    qalloc->prefetch_pending[i] <= max)
+			return true;
+	return false;
+}
+
+static void qubes_prefetch_queue(struct qubes_allocator *qalloc,
+                                 uint32_t pages)
+{
+	struct qubes_buffer *pooled;
+
+	if (!qalloc->reclaim_running || qalloc->destroyed || pages == 0 ||
+	    pages > qubes_buffer_pool_limit(qalloc) ||
+	    qalloc->prefetch_count == QUBES_PREFETCH_MAX)
+		return;
+	/* Speculative grants must never cause pressure */
+	if (qalloc->grant_limit &&
+	    (uint64_t)qalloc->granted_pages + pages > qubes_budget_high_water(qalloc))
+		return;
+	if (qubes_prefetch_is_pending(qalloc, pages, pages))
+		return;
+	wl_list_for_each (pooled, &qalloc->pool, link)
+		if (pooled->pages == pages)
+			return;
+
+	struct qubes_prefetch *job = calloc(1, sizeof(*job));
+	if (!job)
+		return;
+	if (!(job->buffer = qubes_buffer_alloc((int32_t)pages))) {
+		free(job);
+		return;
+	}
+	job->pages = (int32_t)pages;
+	qubes_budget_charge(qalloc, pages);
+	qalloc->prefetch_pending[qalloc->prefetch_count++] = pages;
+	assert(pthread_mutex_lock(&qalloc->reclaim_lock) == 0);
+	wl_list_insert(&qalloc->prefetch_queue, &job->link);
+	assert(pthread_cond_signal(&qalloc->reclaim_cond) == 0);
+	assert(pthread_mutex_unlock(&qalloc->reclaim_lock) == 0);
+}
+
+/*
+ * If the reclaim thread has finished prefetching a buffer of the wanted size
+ * but the main thread has not collected it yet, collects and takes it.  A
+ * prefetch that is still queued or in progress is not waited for, as that
+ * would also wait for every release queued before it; the caller grants a
+ * buffer itself instead, and the prefetched one goes to the pool later.
+ */
+static struct qubes_buffer *qubes_prefetch_take(struct qubes_allocator *qalloc,
+                                                uint32_t min, uint32_t max)
+{
+	struct qubes_prefetch *job;
+	bool done = false;
+
+	if (!qubes_prefetch_is_pending(qalloc, min, max))
+		return NULL;
+	assert(pthread_mutex_lock(&qalloc->reclaim_lock) == 0);
+	wl_list_for_each (job, &qalloc->prefetch_done, link) {
+		if (job->mapped && (uint32_t)job->pages >= min &&
+		    (uint32_t)job->pages <= max) {
+			done = true;
+			break;
+		}
+	}
+	assert(pthread_mutex_unlock(&qalloc->reclaim_lock) == 0);
+	if (!done) {
+		qalloc->prefetch_late++;
+		return NULL;
+	}
+	qubes_reclaim_collect(qalloc);
+	return qubes_buffer_pool_take(qalloc, min, max);
+}
+
+void qubes_allocator_prefetch(struct wlr_allocator *alloc, uint32_t pages)
+{
+	assert(alloc->impl == &qubes_allocator_impl);
+	struct qubes_allocator *qalloc = wl_container_of(alloc, qalloc, inner);
+	qubes_prefetch_queue(qalloc, pages);
+}
+
+struct qubes_arena *qubes_arena_create(struct wlr_allocator *alloc)
+{
+	assert(alloc->impl == &qubes_allocator_impl);
+	struct qubes_allocator *qalloc = wl_container_of(alloc, qalloc, inner);
+	struct qubes_arena *arena = calloc(1, sizeof(*arena));
+	if (!arena)
+		return NULL;
+	arena->alloc = qalloc;
+	qalloc->refcount++;
+	return arena;
+}
+
+static void qubes_arena_region_unref(struct qubes_arena_region *region)
+{
+	assert(region->refcount > 0);
+	if (--region->refcount)
+		return;
+	assert(region->used_slots == 0);
+	struct qubes_allocator *qalloc = region->alloc;
+	if (!qubes_buffer_pool_put(qalloc, region->backing))
+		qubes_buffer_release_grant(qalloc, region->backing);
+	free(region);
+	qubes_allocator_decref(qalloc);
+}
+
+void qubes_arena_reset(struct qubes_arena *arena)
+{
+	if (arena->current) {
+		qubes_arena_region_unref(arena->current);
+		arena->current = NULL;
+	}
+}
+
+void qubes_arena_destroy(struct qubes_arena *arena)
+{
+	if (!arena)
+		return;
+	if (arena->alloc->arena == arena)
+		arena->alloc->arena = NULL;
+	qubes_arena_reset(arena);
+	qubes_allocator_decref(arena->alloc);
+	free(arena);
+}
+
+void qubes_allocator_set_arena(struct wlr_allocator *alloc,
+                               struct qubes_arena *arena)
+{
+	assert(alloc->impl == &qubes_allocator_impl);
+	struct qubes_allocator *qalloc = wl_container_of(alloc, qalloc, inner);
+	assert(arena == NULL || arena->alloc == qalloc);
+	qalloc->arena = arena;
+}
+
+/*
+ * Replaces the arena's region with one whose slots have between min_pages and
+ * max_pages pages.  Buffers in the old region keep it alive until they are
+ * destroyed.
+ */
+static bool qubes_arena_grow(struct qubes_allocator *qalloc,
+                             struct qubes_arena *arena, int32_t min_pages,
+                             int32_t max_pages)
+{
+	struct qubes_arena_region *region = calloc(1, sizeof(*region));
+	if (!region)
+		return false;
+	struct qubes_buffer *backing = qubes_buffer_pool_take(
+	   qalloc, (uint32_t)min_pages * QUBES_ARENA_SLOTS,
+	   (uint32_t)max_pages * QUBES_ARENA_SLOTS);
+	if (!backing)
+		backing = qubes_buffer_grant_budgeted(
+		   qalloc, max_pages * QUBES_ARENA_SLOTS, min_pages * QUBES_ARENA_SLOTS);
+	if (!backing) {
+		free(region);
+		return false;
+	}
+	region->alloc = qalloc;
+	region->backing = backing;
+	region->refcount = 1;
+	region->slot_pages = backing->pages / QUBES_ARENA_SLOTS;
+	qalloc->refcount++;
+	qubes_arena_reset(arena);
+	arena->current = region;
+	return true;
+}
+
+/*
+ * Carves a buffer out of the current arena's region, replacing the region if
+ * it is too small or much too large.  Returns NULL (without logging) if the
+ * buffer should be allocated on its own instead.
+ */
+static struct qubes_buffer *qubes_arena_take(struct qubes_allocator *qalloc,
+                                             int32_t pages, int32_t grant_pages)
+{
+	struct qubes_arena *arena = qalloc->arena;
+	struct qubes_arena_region *region = arena->current;
+
+	if (!region || region->slot_pages < (uint32_t)pages ||
+	    region->slot_pages / 2 > (uint32_t)grant_pages) {
+		if (!qubes_arena_grow(qalloc, arena, pages, grant_pages))
+			return NULL;
+		region = arena->current;
+	}
+	unsigned int slot = 0;
+	while (slot < QUBES_ARENA_SLOTS && (region->used_slots & (1U << slot)))
+		slot++;
+	if (slot == QUBES_ARENA_SLOTS)
+		return NULL;
+
+	struct qubes_buffer *buffer = qubes_buffer_alloc((int32_t)region->slot_pages);
+	if (!buffer)
+		return NULL;
+	const size_t offset = (size_t)slot * region->slot_pages * XC_PAGE_SIZE;
+	buffer->ptr = (char *)region->backing->ptr + offset;
+	buffer->index = region->backing->index + offset;
+	buffer->pages = region->slot_pages;
+	memcpy(qubes_buffer_grefs(buffer),
+	       qubes_buffer_grefs(region->backing) +
+	          (size_t)slot * region->slot_pages,
+	       (size_t)region->slot_pages * SIZEOF_GRANT_REF);
+	buffer->region = region;
+	buffer->region_slot = slot;
+	region->used_slots |= 1U << slot;
+	region->refcount++;
+	return buffer;
+}
+
+static void qubes_arena_put(struct qubes_buffer *buffer)
+{
+	struct qubes_arena_region *region = buffer->region;
+	assert(region->used_slots & (1U << buffer->region_slot));
+	region->used_slots &= ~(1U << buffer->region_slot);
+	free(buffer);
+	qubes_arena_region_unref(region);
+}
+
 static struct wlr_buffer *
 qubes_buffer_create(struct wlr_allocator *alloc, const int width,
                     const int height, const struct wlr_drm_format *format)
@@ -163,50 +1233,289 @@ qubes_buffer_create(struct wlr_allocator *alloc, const int width,
 	const int32_t bytes = pixels * sizeof(uint32_t);
 	const int32_t pages = NUM_PAGES(bytes);
 
-	struct qubes_buffer *buffer =
-	   calloc((size_t)pages * SIZEOF_GRANT_REF +
-	             offsetof(struct qubes_buffer, qubes) + sizeof(buffer->qubes),
-	          1);
-	if (!buffer) {
-		wlr_log(WLR_ERROR, "calloc(3) failed");
-		return NULL;
-	}
-	buffer->xen.domid = qalloc->domid;
-	buffer->xen.flags = GNTALLOC_FLAG_WRITABLE;
-	buffer->xen.count = pages;
-	buffer->format = format->format;
-	int res = ioctl(qalloc->xenfd, IOCTL_GNTALLOC_ALLOC_GREF, &buffer->xen);
-	if (res) {
-		assert(res == -1);
-		report_gntalloc_error();
-		goto fail;
+	/* During an interactive resize, over-allocate so that later steps can
+	 * reuse the same region. */
+	const int32_t grant_pages = QUBES_MAX(pages, (int32_t)qalloc->size_hint);
+	struct qubes_buffer *buffer = NULL;
+	if (qalloc->arena && !qalloc->destroyed)
+		buffer = qubes_arena_take(qalloc, pages, grant_pages);
+	if (buffer) {
+		/* carved out of the window's arena */
+	} else if ((buffer = qubes_buffer_pool_take(qalloc, pages, grant_pages))) {
+		qalloc->pool_hits++;
+	} else if ((buffer = qubes_prefetch_take(qalloc, (uint32_t)pages,
+	                                         (uint32_t)grant_pages))) {
+		qalloc->pool_hits++;
+	} else {
+		qalloc->pool_misses++;
+		if (!(buffer = qubes_buffer_grant_budgeted(qalloc, grant_pages, pages)))
+			return NULL;
+		/* A fresh swapchain will want another buffer of the same size */
+		if (!qalloc->arena)
+			qubes_prefetch_queue(qalloc, (uint32_t)grant_pages);
 	}
-	buffer->index = buffer->xen.index;
+	qubes_buffer_init(qalloc, buffer, width, height, format->format);
+	return &buffer->inner;
+}
+
+/* Fills in the window dump header and accounts for a new live buffer */
+static void qubes_buffer_init(struct qubes_allocator *qalloc,
+                              struct qubes_buffer *buffer, int width,
+                              int height, uint32_t format)
+{
 	buffer->refcount = 1;
-	buffer->size = (size_t)bytes;
+	buffer->size = (size_t)width * (size_t)height * sizeof(uint32_t);
+	buffer->format = format;
 	buffer->qubes.type = 0; /* WINDOW_DUMP_TYPE_GRANT_REFS */
 	buffer->qubes.width = (uint32_t)width;
 	buffer->qubes.height = (uint32_t)height;
 	buffer->qubes.bpp = 24;
-	buffer->ptr = mmap(NULL, (size_t)bytes, PROT_READ | PROT_WRITE, MAP_SHARED,
-	                   qalloc->xenfd, (off_t)buffer->index);
-	if (buffer->ptr != MAP_FAILED) {
-		wlr_buffer_init(&buffer->inner, &qubes_buffer_impl, width, height);
-		qalloc->refcount++;
-		assert(qalloc->refcount);
-		buffer->alloc = qalloc;
-		return &buffer->inner;
-	}
-fail:
-	if (buffer->size) {
-		struct ioctl_gntalloc_dealloc_gref dealloc = {
-			.index = buffer->index,
-			.count = pages,
+	wlr_buffer_init(&buffer->inner, &qubes_buffer_impl, width, height);
+	qalloc->live_buffers++;
+	qalloc->live_pages += buffer->pages;
+	qalloc->live_bytes += buffer->size;
+	qalloc->live_buffers_peak =
+	   QUBES_MAX(qalloc->live_buffers_peak, qalloc->live_buffers);
+	qalloc->live_pages_peak =
+	   QUBES_MAX(qalloc->live_pages_peak, qalloc->live_pages);
+	qalloc->live_bytes_peak =
+	   QUBES_MAX(qalloc->live_bytes_peak, qalloc->live_bytes);
+	qalloc->refcount++;
+	assert(qalloc->refcount);
+	buffer->alloc = qalloc;
+}
+
+bool qubes_allocator_enable_import(struct wlr_allocator *alloc)
+{
+	assert(alloc->impl == &qubes_allocator_impl);
+	struct qubes_allocator *qalloc = wl_container_of(alloc, qalloc, inner);
+
+	if (qalloc->backend == QUBES_ALLOCATOR_GNTALLOC && qalloc->udmabuf_fd == -1) {
+		if ((qalloc->udmabuf_fd =
+		        open("/dev/udmabuf", O_RDWR | O_CLOEXEC | O_NOCTTY)) < 0) {
+			qalloc->udmabuf_fd = -1;
+			return false;
+		}
+		if ((qalloc->gntdev_fd =
+		        open("/dev/xen/gntdev", O_RDWR | O_CLOEXEC | O_NOCTTY)) < 0) {
+			int err = errno;
+			assert(close(qalloc->udmabuf_fd) == 0);
+			qalloc->udmabuf_fd = qalloc->gntdev_fd = -1;
+			errno = err;
+			return false;
+		}
+	}
+	qalloc->import_enabled = true;
+	return true;
+}
+
+/*
+ * Grants the pages of a client's memfd to the GUI domain.  gntalloc can only
+ * grant pages it allocated itself, so the pages are wrapped in a udmabuf,
+ * which gntdev can grant.  udmabuf only takes a memfd sealed against
+ * shrinking (F_SEAL_SHRINK), which qubes_buffer_import() checks first.
+ */
+static bool qubes_buffer_grant_dmabuf(struct qubes_allocator *qalloc,
+                                      struct qubes_buffer *buffer, int memfd,
+                                      off_t offset)
+{
+	struct udmabuf_create create = {
+		.memfd = (uint32_t)memfd,
+		.flags = UDMABUF_FLAGS_CLOEXEC,
+		.offset = (uint64_t)offset,
+		.size = (uint64_t)buffer->pages * XC_PAGE_SIZE,
+	};
+	const uint64_t start = qubes_monotonic_ns();
+	int dmabuf_fd = ioctl(qalloc->udmabuf_fd, UDMABUF_CREATE, &create);
+	if (dmabuf_fd < 0) {
+		wlr_log(WLR_DEBUG, "Cannot create udmabuf: %s", strerror(errno));
+		return false;
+	}
+	const size_t imp_size =
+	   offsetof(struct ioctl_gntdev_dmabuf_imp_to_refs, refs) +
+	   (size_t)buffer->pages * SIZEOF_GRANT_REF;
+	struct ioctl_gntdev_dmabuf_imp_to_refs *imp = calloc(1, imp_size);
+	if (!imp) {
+		wlr_log(WLR_ERROR, "calloc(3) failed");
+		assert(close(dmabuf_fd) == 0);
+		return false;
+	}
+	imp->fd = (uint32_t)dmabuf_fd;
+	imp->count = buffer->pages;
+	imp->domid = qalloc->domid;
+	if (ioctl(qalloc->gntdev_fd, IOCTL_GNTDEV_DMABUF_IMP_TO_REFS, imp) != 0) {
+		report_gntalloc_error();
+		free(imp);
+		assert(close(dmabuf_fd) == 0);
+		return false;
+	}
+	memcpy(qubes_buffer_grefs(buffer), imp->refs,
+	       (size_t)buffer->pages * SIZEOF_GRANT_REF);
+	free(imp);
+	qubes_latency_record(&qalloc->alloc_latency, qubes_monotonic_ns() - start);
+	buffer->dmabuf_fd = dmabuf_fd;
+	return true;
+}
+
+/*
+ * The window dump protocol has no stride or offset, so the pixels must be
+ * tightly packed and start on a page boundary.  The pool must also extend to
+ * the end of the last page, which the GUI daemon maps in full.
+ */
+static struct qubes_buffer *qubes_buffer_import(struct qubes_allocator *qalloc,
+                                                struct wlr_buffer *source)
+{
+	struct wlr_shm_attributes shm;
+	struct stat st;
+
+	if (!wlr_buffer_get_shm(source, &shm))
+		return NULL;
+	if ((shm.format != DRM_FORMAT_XRGB8888 &&
+	     shm.format != DRM_FORMAT_ARGB8888) ||
+	    shm.width < 1 || shm.width > MAX_WINDOW_WIDTH || shm.height < 1 ||
+	    shm.height > MAX_WINDOW_HEIGHT ||
+	    shm.stride != shm.width * (int)sizeof(uint32_t) ||
+	    shm.offset % XC_PAGE_SIZE != 0)
+		return NULL;
+	/* the remaining computations cannot overflow */
+	const int32_t pages = NUM_PAGES(shm.stride * shm.height);
+	const size_t length = (size_t)pages * XC_PAGE_SIZE;
+	if (fstat(shm.fd, &st) != 0 || st.st_size < shm.offset + (off_t)length)
+		return NULL;
+	if (qalloc->grant_limit &&
+	    qalloc->granted_pages + (uint32_t)pages > qalloc->grant_limit)
+		return NULL;
+	/* Pools that are plain files, or memfds the client left unsealed (as
+	 * wl_shm does not ask for seals), cannot be wrapped in a udmabuf */
+	if (qalloc->backend == QUBES_ALLOCATOR_GNTALLOC &&
+	    qubes_buffer_may_shrink(source)) {
+		qalloc->imports_unsealed++;
+		return NULL;
+	}
+
+	struct qubes_buffer *buffer = qubes_buffer_alloc(pages);
+	if (!buffer)
+		return NULL;
+	buffer->imported = true;
+	buffer->dmabuf_fd = -1;
+	buffer->pages = (uint32_t)pages;
+	buffer->ptr =
+	   mmap(NULL, length, PROT_READ, MAP_SHARED, shm.fd, shm.offset);
+	if (buffer->ptr == MAP_FAILED) {
+		wlr_log(WLR_ERROR, "mmap() failed: %s", strerror(errno));
+		free(buffer);
+		return NULL;
+	}
+	if (qalloc->backend == QUBES_ALLOCATOR_SHM) {
+		qubes_buffer_fake_grefs(qalloc, buffer);
+	} else if (!qubes_buffer_grant_dmabuf(qalloc, buffer, shm.fd, shm.offset)) {
+		assert(munmap(buffer->ptr, length) == 0);
+		free(buffer);
+		return NULL;
+	}
+	qubes_budget_charge(qalloc, buffer->pages);
+	qalloc->imported_buffers++;
+	qalloc->imported_pages += buffer->pages;
+	qubes_buffer_init(qalloc, buffer, shm.width, shm.height, shm.format);
+	return buffer;
+}
+
+static void qubes_buffer_release_import(struct qubes_allocator *qalloc,
+                                        struct qubes_buffer *buffer)
+{
+	assert(!buffer->import && "client buffer still attached?");
+	assert(qalloc->imported_buffers > 0 &&
+	       qalloc->imported_pages >= buffer->pages);
+	qalloc->imported_buffers--;
+	qalloc->imported_pages -= buffer->pages;
+	assert(munmap(buffer->ptr, (size_t)buffer->pages * XC_PAGE_SIZE) == 0);
+	if (buffer->dmabuf_fd != -1) {
+		struct ioctl_gntdev_dmabuf_imp_release release = {
+			.fd = (uint32_t)buffer->dmabuf_fd,
 		};
-		assert(ioctl(qalloc->xenfd, IOCTL_GNTALLOC_DEALLOC_GREF, &dealloc) == 0);
+		/* Grants the daemon still has mapped are ended once it unmaps them */
+		if (ioctl(qalloc->gntdev_fd, IOCTL_GNTDEV_DMABUF_IMP_RELEASE, &release))
+			wlr_log(WLR_ERROR, "Cannot release imported buffer: %s",
+			        strerror(errno));
+		assert(close(buffer->dmabuf_fd) == 0);
 	}
+	qubes_budget_credit(qalloc, buffer->pages);
 	free(buffer);
-	return NULL;
+}
+
+static void qubes_import_destroy(struct wlr_addon *addon)
+{
+	struct qubes_import *import = wl_container_of(addon, import, addon);
+
+	wlr_addon_finish(addon);
+	if (import->buffer) {
+		import->buffer->import = NULL;
+		/* Freed now, or when the daemon acknowledges its last dump */
+		wlr_buffer_drop(&import->buffer->inner);
+	}
+	free(import);
+}
+
+static const struct wlr_addon_interface qubes_import_addon_impl = {
+	.name = "qubes_import",
+	.destroy = qubes_import_destroy,
+};
+
+struct wlr_buffer *qubes_allocator_import(struct wlr_allocator *alloc,
+                                          struct wlr_buffer *client)
+{
+	assert(alloc->impl == &qubes_allocator_impl);
+	struct qubes_allocator *qalloc = wl_container_of(alloc, qalloc, inner);
+	if (!qalloc->import_enabled || qalloc->destroyed)
+		return NULL;
+
+	/* Surfaces are shown through a wlr_client_buffer wrapping the buffer
+	 * that the client attached */
+	struct wlr_buffer *source = client;
+	struct wlr_client_buffer *client_buffer = wlr_client_buffer_get(client);
+	if (client_buffer && !(source = client_buffer->source))
+		return NULL;
+
+	struct qubes_import *import;
+	struct wlr_addon *addon =
+	   wlr_addon_find(&source->addons, qalloc, &qubes_import_addon_impl);
+	if (addon) {
+		import = wl_container_of(addon, import, addon);
+		return import->buffer ? &import->buffer->inner : NULL;
+	}
+	if (!(import = calloc(1, sizeof(*import)))) {
+		wlr_log(WLR_ERROR, "calloc(3) failed");
+		return NULL;
+	}
+	import->source = source;
+	if ((import->buffer = qubes_buffer_import(qalloc, source))) {
+		import->buffer->import = import;
+		qalloc->imports++;
+	} else {
+		qalloc->imports_refused++;
+	}
+	/* Refusals are remembered too, so that they are not retried every frame */
+	wlr_addon_init(&import->addon, &source->addons, qalloc,
+	               &qubes_import_addon_impl);
+	return import->buffer ? &import->buffer->inner : NULL;
+}
+
+struct wlr_buffer *qubes_buffer_import_source(struct wlr_buffer *raw_buffer)
+{
+	if (!raw_buffer || raw_buffer->impl != &qubes_buffer_impl)
+		return NULL;
+	struct qubes_buffer *buffer = wl_container_of(raw_buffer, buffer, inner);
+	return buffer->import ? buffer->import->source : NULL;
+}
+
+bool qubes_buffer_may_shrink(struct wlr_buffer *buffer)
+{
+	struct wlr_shm_attributes shm;
+
+	if (!wlr_buffer_get_shm(buffer, &shm))
+		return false;
+	const int seals = fcntl(shm.fd, F_GET_SEALS);
+	return seals == -1 || !(seals & F_SEAL_SHRINK);
 }
 
 static bool qubes_buffer_begin_data_ptr_access(struct wlr_buffer *raw_buffer,
@@ -218,6 +1527,9 @@ static bool qubes_buffer_begin_data_ptr_access(struct wlr_buffer *raw_buffer,
 	              (uint32_t)WLR_BUFFER_DATA_PTR_ACCESS_WRITE))
 		return false;
 	struct qubes_buffer *buffer = wl_container_of(raw_buffer, buffer, inner);
+	/* Only the client draws into its own pages */
+	if (buffer->imported && (flags & WLR_BUFFER_DATA_PTR_ACCESS_WRITE))
+		return false;
 	if (stride)
 		*stride = buffer->qubes.width * sizeof(uint32_t);
 	if (data)
@@ -237,16 +1549,69 @@ void qubes_buffer_destroy(struct wlr_buffer *raw_buffer)
 		return;
 	}
 	assert(buffer->refcount == 1);
-	struct ioctl_gntalloc_dealloc_gref dealloc = {
-		.index = buffer->index,
-		.count = NUM_PAGES(buffer->size),
-	};
-	assert(munmap(buffer->ptr, buffer->size) == 0);
-	if (buffer->alloc->xenfd != -1)
-		assert(ioctl(buffer->alloc->xenfd, IOCTL_GNTALLOC_DEALLOC_GREF,
-		             &dealloc) == 0);
-	qubes_allocator_decref(buffer->alloc);
-	free(buffer);
+	buffer->refcount = 0;
+	struct qubes_allocator *qalloc = buffer->alloc;
+	buffer->alloc = NULL;
+	assert(qalloc->live_buffers > 0 && qalloc->live_pages >= buffer->pages &&
+	       qalloc->live_bytes >= buffer->size);
+	qalloc->live_buffers--;
+	qalloc->live_pages -= buffer->pages;
+	qalloc->live_bytes -= buffer->size;
+	if (buffer->imported)
+		qubes_buffer_release_import(qalloc, buffer);
+	else if (buffer->region)
+		qubes_arena_put(buffer);
+	else if (!qubes_buffer_pool_put(qalloc, buffer))
+		qubes_buffer_release_grant(qalloc, buffer);
+	qubes_allocator_decref(qalloc);
+}
+
+void qubes_allocator_dump_stats(struct wlr_allocator *alloc, FILE *out)
+{
+	assert(alloc->impl == &qubes_allocator_impl);
+	struct qubes_allocator *qalloc = wl_container_of(alloc, qalloc, inner);
+	struct qubes_latency_histogram dealloc_latency;
+
+	if (qalloc->reclaim_running)
+		assert(pthread_mutex_lock(&qalloc->reclaim_lock) == 0);
+	dealloc_latency = qalloc->dealloc_latency;
+	if (qalloc->reclaim_running)
+		assert(pthread_mutex_unlock(&qalloc->reclaim_lock) == 0);
+
+	fprintf(out,
+	        "Allocator (%s):\n"
+	        "  live buffers: %" PRIu32 " (peak %" PRIu32 ")\n"
+	        "  live pages: %" PRIu32 " (peak %" PRIu32 ")\n"
+	        "  live bytes: %" PRIu64 " (peak %" PRIu64 ")\n"
+	        "  granted pages: %" PRIu32 " (peak %" PRIu32 ", limit %" PRIu32
+	        ")\n"
+	        "  granted bytes: %" PRIu64 "\n"
+	        "  pooled pages: %" PRIu32 " (limit %" PRIu32 "), %" PRIu64
+	        " hits, %" PRIu64 " misses\n"
+	        "  pages being released: %" PRIu32 "\n"
+	        "  prefetched buffers: %" PRIu64 ", %" PRIu64 " used, %" PRIu64
+	        " still in flight when needed\n"
+	        "  allocations refused: %" PRIu64 "\n"
+	        "  imported client buffers: %" PRIu32 " live (%" PRIu32
+	        " pages), %" PRIu64 " imported, %" PRIu64 " refused (%" PRIu64
+	        " from pools not sealed against shrinking)\n",
+	        qalloc->backend == QUBES_ALLOCATOR_SHM ? "shm" : "gntalloc",
+	        qalloc->live_buffers, qalloc->live_buffers_peak, qalloc->live_pages,
+	        qalloc->live_pages_peak, qalloc->live_bytes, qalloc->live_bytes_peak,
+	        qalloc->granted_pages, qalloc->granted_peak, qalloc->grant_limit,
+	        (uint64_t)qalloc->granted_pages * XC_PAGE_SIZE, qalloc->pool_pages,
+	        qubes_buffer_pool_limit(qalloc), qalloc->pool_hits,
+	        qalloc->pool_misses, qalloc->reclaim_pages, qalloc->prefetched,
+	        qalloc->prefetch_used, qalloc->prefetch_late,
+	        qalloc->budget_refusals, qalloc->imported_buffers,
+	        qalloc->imported_pages, qalloc->imports, qalloc->imports_refused,
+	        qalloc->imports_unsealed);
+	qubes_latency_dump(out, "alloc", &qalloc->alloc_latency);
+	qubes_latency_dump(out, "map", &qalloc->map_latency);
+	qubes_latency_dump(out, "dealloc", &dealloc_latency);
+	qubes_latency_dump(out, "event loop blocked by release", &qalloc->teardown);
+	qubes_latency_dump(out, "release until pages returned",
+	                   &qalloc->release_latency);
 }
 
 // vim: set noet ts=3 sts=3 sw=3 ft=c fenc=UTF-8:
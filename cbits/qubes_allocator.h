@@ -3,27 +3,179 @@
 	_Pragma("GCC error \"double-include guard referenced\"")
 
 #include "common.h"
+#include <stdio.h>
 #include <qubes-gui-protocol.h>
 #include <wlr/render/allocator.h>
 #include <xen/gntalloc.h>
 
+struct wl_event_loop;
+struct wl_listener;
+
+enum qubes_allocator_backend {
+	/* Grant pages from /dev/xen/gntalloc */
+	QUBES_ALLOCATOR_GNTALLOC,
+	/*
+	 * POSIX shared memory with made-up grant references.  The GUI daemon
+	 * cannot map these buffers, so this is only useful for testing and
+	 * profiling the compositor without gntalloc.  The compositor refuses
+	 * to talk to a GUI daemon with it, see qubes_allocator_has_grants().
+	 */
+	QUBES_ALLOCATOR_SHM,
+};
+
 /**
  * Creates an allocator, owned by main()
  */
-struct wlr_allocator *qubes_allocator_create(uint16_t domid);
+struct wlr_allocator *
+qubes_allocator_create(uint16_t domid, enum qubes_allocator_backend backend);
+/**
+ * Whether the grant references in MSG_WINDOW_DUMP refer to real grant pages.
+ * They do not with QUBES_ALLOCATOR_SHM, and must then never be sent to a GUI
+ * daemon, as it would try to map whatever the references belong to.
+ */
+bool qubes_allocator_has_grants(struct wlr_allocator *alloc);
+/**
+ * Sets the maximum number of grant pages kept in the buffer pool.  Freed
+ * buffers are kept mapped and granted so that a later allocation with the same
+ * number of pages can reuse them.  0 disables the pool.
+ */
+void qubes_allocator_set_pool_limit(struct wlr_allocator *alloc,
+                                    uint32_t max_pages);
+/**
+ * Makes room in the buffer pool for over-sized buffers allocated while an
+ * interactive resize is in progress, so that they survive from one resize
+ * step to the next.  Must be balanced by qubes_allocator_end_reserve().
+ */
+void qubes_allocator_begin_reserve(struct wlr_allocator *alloc, uint32_t pages);
+void qubes_allocator_end_reserve(struct wlr_allocator *alloc, uint32_t pages);
+/**
+ * While nonzero, allocations needing fewer than this many pages are given a
+ * region of this many pages, or any pooled region large enough.  Only the
+ * grant references actually needed are sent in MSG_WINDOW_DUMP.
+ */
+void qubes_allocator_set_size_hint(struct wlr_allocator *alloc,
+                                   uint32_t pages);
+/**
+ * Sets the number of grant pages that can be allocated.  As usage approaches
+ * the limit, pooled buffers are evicted and pressure listeners are asked to
+ * release buffers they can do without.  Allocations that would exceed the
+ * limit are refused.  0 (the default) means that the limit is unknown and
+ * only the kernel enforces it.  Ignored for the shared memory backend.
+ */
+void qubes_allocator_set_grant_limit(struct wlr_allocator *alloc,
+                                     uint32_t pages);
+/**
+ * Emitted with a struct qubes_allocator_pressure_event when grant pages are
+ * running out.  Listeners should drop buffers they do not need right now,
+ * such as spare swapchain slots.
+ */
+struct qubes_allocator_pressure_event {
+	uint32_t pages; /* how many pages would relieve the pressure */
+};
+void qubes_allocator_add_pressure_listener(struct wlr_allocator *alloc,
+                                           struct wl_listener *listener);
+/**
+ * Starts a thread that unmaps and ungrants freed buffers, so that the event
+ * loop does not wait for the kernel to tear down large mappings.  Completed
+ * buffers are collected on the given event loop.  Returns false and sets errno
+ * on failure, in which case buffers are released synchronously.  The thread is
+ * stopped when the allocator is destroyed.
+ */
+bool qubes_allocator_start_reclaim(struct wlr_allocator *alloc,
+                                   struct wl_event_loop *loop);
+/**
+ * Asks the thread started by qubes_allocator_start_reclaim() to grant, map,
+ * and prefault a buffer of the given number of pages and put it in the pool,
+ * because a buffer of that size is expected to be allocated soon.  Does
+ * nothing if there is no such thread, if a buffer of that size is already
+ * pooled or on its way, or if granting it would put the budget under pressure.
+ */
+void qubes_allocator_prefetch(struct wlr_allocator *alloc, uint32_t pages);
+/**
+ * Enables qubes_allocator_import().  With the gntalloc backend, this needs
+ * /dev/udmabuf and /dev/xen/gntdev.  Returns false and sets errno if they
+ * cannot be opened.
+ */
+bool qubes_allocator_enable_import(struct wlr_allocator *alloc);
+/**
+ * Zero-copy support.  Grants the pages of a client's wl_shm buffer (or of the
+ * wl_shm buffer behind a wlr_client_buffer) to the GUI domain, so that it can
+ * be sent in MSG_WINDOW_DUMP as is instead of being composited into a buffer
+ * from the allocator.  The import is cached until the client buffer is
+ * destroyed.  Returns NULL if the buffer cannot be imported, for instance
+ * because of its format, stride, or offset in the pool, in which case the
+ * caller must composite it as usual.  With the gntalloc backend, only pools
+ * that are memfds sealed with F_SEAL_SHRINK can be imported.  The returned
+ * buffer is not locked.
+ */
+struct wlr_buffer *qubes_allocator_import(struct wlr_allocator *alloc,
+                                          struct wlr_buffer *client);
+/**
+ * Returns the client buffer that an imported buffer shares its pages with, or
+ * NULL for other buffers.  The client must not draw into it while the GUI
+ * daemon may be showing it, so the caller keeps it locked meanwhile.
+ */
+struct wlr_buffer *qubes_buffer_import_source(struct wlr_buffer *buffer);
+/**
+ * Returns true if buffer is backed by a client's shm pool that the client can
+ * truncate, which makes reading it raise SIGBUS.  libwayland only handles
+ * that on the thread that began the access, so such pixels must not be read
+ * anywhere else.  Buffers the compositor allocated cannot shrink.
+ */
+bool qubes_buffer_may_shrink(struct wlr_buffer *buffer);
+/**
+ * Returns the number of helper threads the allocator is running.
+ */
+unsigned int qubes_allocator_thread_count(struct wlr_allocator *alloc);
+/**
+ * A per-window grant arena.  Buffers allocated while an arena is set are
+ * carved out of a single grant region with room for several buffers of the
+ * same size, so a window's swapchain needs one gntalloc allocation and one
+ * mapping instead of one per buffer.  If the region is too small, a new one
+ * is allocated; the old one is released once the buffers in it are gone.
+ */
+struct qubes_arena;
+struct qubes_arena *qubes_arena_create(struct wlr_allocator *alloc);
+/* Lets go of the arena's region, so that it is freed with its last buffer */
+void qubes_arena_reset(struct qubes_arena *arena);
+void qubes_arena_destroy(struct qubes_arena *arena);
+/**
+ * Sets the arena used for subsequent allocations, or NULL for none.
+ */
+void qubes_allocator_set_arena(struct wlr_allocator *alloc,
+                               struct qubes_arena *arena);
+/**
+ * Writes live buffer, page, and byte counts (with their peaks), grant budget
+ * and pool usage, and latency histograms for granting, mapping, and releasing
+ * buffers to the given stream.
+ */
+void qubes_allocator_dump_stats(struct wlr_allocator *alloc, FILE *out);
 extern const struct wlr_buffer_impl *qubes_buffer_impl_addr;
 void qubes_buffer_destroy(struct wlr_buffer *buffer);
 
+struct qubes_import;
+
 /**
  * Qubes OS buffer.  Owned by wlroots.
  */
 struct qubes_buffer {
 	uint64_t refcount;
 	struct wlr_buffer inner;
+	/* buffer pool LRU while pooled, reclaim queue while being released */
+	struct wl_list link;
 	void *ptr;
 	struct qubes_allocator *alloc;
 	uint64_t index;
 	size_t size;
+	uint32_t pages; /* granted and mapped, not necessarily NUM_PAGES(size) */
+	struct qubes_arena_region *region; /* NULL unless carved from an arena */
+	uint32_t region_slot;
+	bool prefetched; /* pooled by the prefetcher and not used yet */
+	uint64_t release_ns; /* when it was queued for the reclaim thread */
+	/* Set if the pages belong to a client, see qubes_allocator_import() */
+	bool imported;
+	int dmabuf_fd;               /* the udmabuf granted to the daemon, or -1 */
+	struct qubes_import *import; /* NULL once the client buffer is gone */
 	union {
 		struct {
 			uint32_t format;
@@ -143,7 +143,8 @@ static const struct wlr_output_impl qubes_backend_output_impl = {
 struct qubes_backend *qubes_backend_create(struct wl_display *display,
                                            uint16_t domid,
                                            struct wl_list *views,
-                                           struct wlr_output *output)
+                                           struct wlr_output *output,
+                                           int32_t refresh_mhz)
 {
 	struct qubes_backend *backend = calloc(1, sizeof(*backend));
 	struct wlr_keyboard *keyboard = calloc(1, sizeof(*keyboard));
@@ -158,7 +159,7 @@ struct qubes_backend *qubes_backend_create(struct wl_display *display,
 	}
 	backend->mode.width = 1920;
 	backend->mode.height = 1080;
-	backend->mode.refresh = 60000;
+	backend->mode.refresh = refresh_mhz;
 	backend->mode.preferred = true;
 	wl_list_init(&backend->mode.link);
 	backend->views = views;
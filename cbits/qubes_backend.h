@@ -33,7 +33,8 @@ extern int qubes_rust_backend_fd(struct qubes_rust_backend *backend);
 
 struct qubes_backend *qubes_backend_create(struct wl_display *, uint16_t,
                                            struct wl_list *,
-                                           struct wlr_output *headless_output);
+                                           struct wlr_output *headless_output,
+                                           int32_t refresh_mhz);
 typedef void (*qubes_parse_event_callback)(void *raw_view, void *raw_backend,
                                            uint32_t timestamp,
                                            struct msg_hdr hdr,
@@ -0,0 +1,85 @@
+// Coalescing of damage rectangles into few MSG_SHMIMAGE messages
+
+#include "common.h"
+
+#include "qubes_damage.h"
+
+static pixman_box32_t qubes_box_union(const pixman_box32_t *a,
+                                      const pixman_box32_t *b)
+{
+	return (pixman_box32_t){
+		.x1 = QUBES_MIN(a->x1, b->x1),
+		.y1 = QUBES_MIN(a->y1, b->y1),
+		.x2 = QUBES_MAX(a->x2, b->x2),
+		.y2 = QUBES_MAX(a->y2, b->y2),
+	};
+}
+
+/*
+ * How much more it costs to send the bounding box of a and b in one message
+ * than to send them separately, if a message costs as much as message_cost
+ * pixels.  Zero or less means that merging them pays off.
+ */
+static int64_t qubes_box_merge_cost(const pixman_box32_t *a,
+                                    const pixman_box32_t *b,
+                                    uint32_t message_cost)
+{
+	const pixman_box32_t merged = qubes_box_union(a, b);
+	return qubes_box_area(&merged) - qubes_box_area(a) - qubes_box_area(b) -
+	       (int64_t)message_cost;
+}
+
+/*
+ * Rectangles come from pixman in y-x order, so each one is first tried against
+ * its predecessor; once out holds QUBES_DAMAGE_MAX_RECTS rectangles, further
+ * ones are merged into whichever rectangle that costs the least.  Finally the
+ * cheapest pair is merged until no merge pays off.
+ */
+int qubes_damage_coalesce(const pixman_box32_t *rects, int n_rects,
+                          uint32_t message_cost, pixman_box32_t *out)
+{
+	int n_out = 0;
+	for (int i = 0; i < n_rects; ++i) {
+		const pixman_box32_t *rect = rects + i;
+		if (rect->x2 <= rect->x1 || rect->y2 <= rect->y1)
+			continue;
+		if (n_out > 0 &&
+		    qubes_box_merge_cost(&out[n_out - 1], rect, message_cost) <= 0) {
+			out[n_out - 1] = qubes_box_union(&out[n_out - 1], rect);
+		} else if (n_out < QUBES_DAMAGE_MAX_RECTS) {
+			out[n_out++] = *rect;
+		} else {
+			int best = 0;
+			int64_t best_cost = INT64_MAX;
+			for (int j = 0; j < n_out; ++j) {
+				const int64_t cost =
+				   qubes_box_merge_cost(&out[j], rect, message_cost);
+				if (cost < best_cost) {
+					best = j;
+					best_cost = cost;
+				}
+			}
+			out[best] = qubes_box_union(&out[best], rect);
+		}
+	}
+	for (;;) {
+		int best_i = -1, best_j = -1;
+		int64_t best_cost = 1;
+		for (int i = 0; i < n_out; ++i) {
+			for (int j = i + 1; j < n_out; ++j) {
+				const int64_t cost =
+				   qubes_box_merge_cost(&out[i], &out[j], message_cost);
+				if (cost < best_cost) {
+					best_i = i;
+					best_j = j;
+					best_cost = cost;
+				}
+			}
+		}
+		if (best_i < 0)
+			return n_out;
+		out[best_i] = qubes_box_union(&out[best_i], &out[best_j]);
+		out[best_j] = out[--n_out];
+	}
+}
+// vim: set noet ts=3 sts=3 sw=3 ft=c fenc=UTF-8:
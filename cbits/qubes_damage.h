@@ -0,0 +1,27 @@
+#ifndef QUBES_WAYLAND_COMPOSITOR_QUBES_DAMAGE_H
+#define QUBES_WAYLAND_COMPOSITOR_QUBES_DAMAGE_H                                \
+	_Pragma("GCC error \"double-include guard referenced\"")
+#include "common.h"
+
+#include <pixman.h>
+
+/* At most this many MSG_SHMIMAGE messages are sent per frame when coalescing */
+#define QUBES_DAMAGE_MAX_RECTS 32
+
+static inline int64_t qubes_box_area(const pixman_box32_t *box)
+{
+	return ((int64_t)box->x2 - box->x1) * ((int64_t)box->y2 - box->y1);
+}
+
+/**
+ * Merges damage rectangles whenever sending their bounding box is cheaper
+ * than sending them separately, if a message costs as much as message_cost
+ * pixels.  Empty rectangles are skipped.  out must have room for
+ * QUBES_DAMAGE_MAX_RECTS rectangles.  Returns the number of rectangles stored
+ * in out, which together cover every rectangle in rects.
+ */
+int qubes_damage_coalesce(const pixman_box32_t *rects, int n_rects,
+                          uint32_t message_cost, pixman_box32_t *out);
+
+#endif
+// vim: set noet ts=3 sts=3 sw=3 ft=c fenc=UTF-8:
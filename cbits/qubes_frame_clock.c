@@ -0,0 +1,67 @@
+// Frame timer that only runs while something waits for a frame
+
+#include "common.h"
+#include <time.h>
+
+#include <wayland-server-core.h>
+
+#include "qubes_frame_clock.h"
+
+static uint64_t qubes_frame_clock_now_ns(void)
+{
+	struct timespec now;
+	assert(clock_gettime(CLOCK_MONOTONIC, &now) == 0);
+	return (uint64_t)now.tv_sec * UINT64_C(1000000000) + (uint64_t)now.tv_nsec;
+}
+
+static int qubes_frame_clock_fired(void *data)
+{
+	struct qubes_frame_clock *clock = data;
+
+	clock->pending = false;
+	clock->ticks++;
+	clock->tick(clock->data);
+	return 0;
+}
+
+bool qubes_frame_clock_init(struct qubes_frame_clock *clock,
+                            struct wl_event_loop *loop, uint32_t refresh_mhz,
+                            void (*tick)(void *data), void *data)
+{
+	*clock = (struct qubes_frame_clock){
+		.tick = tick,
+		.data = data,
+	};
+	qubes_frame_clock_set_refresh(clock, refresh_mhz);
+	clock->timer = wl_event_loop_add_timer(loop, qubes_frame_clock_fired, clock);
+	return clock->timer != NULL;
+}
+
+void qubes_frame_clock_finish(struct qubes_frame_clock *clock)
+{
+	if (clock->timer)
+		wl_event_source_remove(clock->timer);
+	clock->timer = NULL;
+	clock->pending = false;
+}
+
+void qubes_frame_clock_set_refresh(struct qubes_frame_clock *clock,
+                                   uint32_t refresh_mhz)
+{
+	assert(refresh_mhz > 0);
+	clock->interval_ns = UINT64_C(1000000000000) / refresh_mhz;
+}
+
+void qubes_frame_clock_schedule(struct qubes_frame_clock *clock)
+{
+	if (clock->pending)
+		return;
+	uint64_t const interval = clock->interval_ns;
+	uint64_t const now = qubes_frame_clock_now_ns();
+	uint64_t const next = (now / interval + 1) * interval;
+	int const ms = (int)((next - now + 999999) / 1000000);
+	/* 0 would disarm the timer */
+	wl_event_source_timer_update(clock->timer, ms > 0 ? ms : 1);
+	clock->pending = true;
+}
+// vim: set noet ts=3 sts=3 sw=3 ft=c fenc=UTF-8:
@@ -0,0 +1,38 @@
+#ifndef QUBES_WAYLAND_COMPOSITOR_QUBES_FRAME_CLOCK_H
+#define QUBES_WAYLAND_COMPOSITOR_QUBES_FRAME_CLOCK_H                           \
+	_Pragma("GCC error \"double-include guard referenced\"")
+#include "common.h"
+
+struct wl_event_loop;
+struct wl_event_source;
+
+/*
+ * Frame ticks, aligned to multiples of the refresh interval.  The timer is
+ * only armed while something waits for a tick, so that an idle compositor
+ * does not wake up at all.
+ */
+struct qubes_frame_clock {
+	struct wl_event_source *timer;
+	void (*tick)(void *data);
+	void *data;
+	uint64_t interval_ns;
+	uint64_t ticks; /* timer wakeups, to check that idle means idle */
+	bool pending;   /* the timer is armed */
+};
+
+/**
+ * Sets up a clock that calls tick(data) on each tick.  Returns false if the
+ * timer cannot be created.
+ */
+bool qubes_frame_clock_init(struct qubes_frame_clock *clock,
+                            struct wl_event_loop *loop, uint32_t refresh_mhz,
+                            void (*tick)(void *data), void *data);
+void qubes_frame_clock_finish(struct qubes_frame_clock *clock);
+/** Takes effect from the next tick that is scheduled */
+void qubes_frame_clock_set_refresh(struct qubes_frame_clock *clock,
+                                   uint32_t refresh_mhz);
+/** Arms the timer for the next tick, unless it is armed already */
+void qubes_frame_clock_schedule(struct qubes_frame_clock *clock);
+
+#endif
+// vim: set noet ts=3 sts=3 sw=3 ft=c fenc=UTF-8:
@@ -351,6 +351,10 @@ static void handle_window_flags(struct qubes_output *output, const uint8_t *ptr)
 		return;
 	}
 
+	if ((flags.flags_set | flags.flags_unset) & WINDOW_FLAG_MINIMIZE)
+		qubes_output_set_minimized(output,
+		                           flags.flags_set & WINDOW_FLAG_MINIMIZE);
+
 	if (QUBES_VIEW_MAGIC != output->magic) {
 		assert(QUBES_XWAYLAND_MAGIC == output->magic);
 		wlr_log(WLR_ERROR,
@@ -465,9 +469,11 @@ static void qubes_reconnect(struct qubes_backend *const backend,
 	switch (msg_type) {
 	case 2: {
 		struct wlr_output_state state;
+		/* Keeps the refresh rate, see qubes_commit_refresh_rate() */
+		backend->mode.width = (int32_t)config->w;
+		backend->mode.height = (int32_t)config->h;
 		wlr_output_state_init(&state);
-		wlr_output_state_set_custom_mode(&state, (uint32_t)config->w,
-		                                 (uint32_t)config->h, 0);
+		wlr_output_state_set_mode(&state, &backend->mode);
 		wlr_output_commit_state(backend->output, &state);
 		wlr_output_state_finish(&state);
 		backend->xconf = *config;
@@ -475,11 +481,22 @@ static void qubes_reconnect(struct qubes_backend *const backend,
 		unsigned int const minor_version = protocol_version & 0xFFFF;
 		backend->protocol_version = protocol_version;
 		assert(major_version == 1);
+		struct tinywl_server *server =
+		   wl_container_of(backend->views, server, views);
+		if (!qubes_allocator_has_grants(server->allocator)) {
+			sd_notify(0, "STATUS=GUI daemon connected, but buffers are not "
+			             "granted (fatal)\nSTOPPING=1\n");
+			wlr_log(WLR_ERROR, "Fatal error: a GUI daemon connected, but the "
+			                   "shm allocator is in use");
+			wl_display_terminate(backend->display);
+			return;
+		}
 		sd_notifyf(
 		   0, "READY=1\nSTATUS=GUI daemon reconnected, protocol version %u.%u\n",
 		   major_version, minor_version);
 		wlr_log(WLR_INFO, "GUI daemon reconnected, protocol version %u.%u\n",
 		        major_version, minor_version);
+		qubes_output_drop_dumps(server);
 		struct qubes_output *output;
 		wl_list_for_each (output, backend->views, link) {
 			output->flags &= ~QUBES_OUTPUT_CREATED;
@@ -674,8 +691,7 @@ void qubes_parse_event(void *raw_backend, void *raw_view, uint32_t timestamp,
 		} else {
 			assert(link != server->queue_tail);
 		}
-		qubes_buffer_destroy(&link->buffer->inner);
-		free(link);
+		qubes_output_dump_acked(server, link);
 		break;
 	}
 	case MSG_RESIZE:
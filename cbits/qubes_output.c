@@ -5,11 +5,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include <wayland-server-core.h>
 
 #include <wlr/interfaces/wlr_keyboard.h>
 #include <wlr/render/drm_format_set.h>
+#include <wlr/render/swapchain.h>
+#include <wlr/types/wlr_buffer.h>
 #include <wlr/types/wlr_data_device.h>
 #include <wlr/types/wlr_output.h>
 #include <wlr/types/wlr_output_layout.h>
@@ -20,7 +23,10 @@
 #include "main.h"
 #include "qubes_allocator.h"
 #include "qubes_backend.h"
+#include "qubes_damage.h"
 #include "qubes_output.h"
+#include "qubes_pixel_diff.h"
+#include "qubes_render_pool.h"
 #include "qubes_wayland.h"
 #include "qubes_xwayland.h"
 #include <drm_fourcc.h>
@@ -55,6 +61,8 @@ static void qubes_output_deinit_raw(struct wlr_output *raw_output)
 	struct qubes_output *output = wl_container_of(raw_output, output, output);
 	wl_list_remove(&output->frame.link);
 	wlr_buffer_unlock(output->buffer);
+	wlr_buffer_unlock(output->client_buffer);
+	output->client_buffer = NULL;
 	qubes_unlink_buffer(output);
 }
 
@@ -70,38 +78,85 @@ static bool qubes_output_test(struct wlr_output *raw_output,
 	return true;
 }
 
+/*
+ * Narrows damage down to the tiles whose pixels differ from the previously
+ * dumped buffer, for clients that damage far more than they change.  Returns
+ * false if the buffers cannot be compared.
+ */
+static bool qubes_output_diff_damage(struct qubes_output *output,
+                                     struct wlr_buffer *previous,
+                                     const pixman_region32_t *damage,
+                                     pixman_region32_t *changed)
+{
+	if (!output->server->damage_diff || !previous ||
+	    previous->impl != qubes_buffer_impl_addr ||
+	    output->buffer->impl != qubes_buffer_impl_addr)
+		return false;
+	struct qubes_buffer *old = wl_container_of(previous, old, inner);
+	struct qubes_buffer *new = wl_container_of(output->buffer, new, inner);
+	if (old->qubes.width != new->qubes.width ||
+	    old->qubes.height != new->qubes.height)
+		return false;
+	output->damage_stats.diff_examined += qubes_pixel_diff(
+	   old->ptr, new->ptr, new->qubes.width, new->qubes.height, damage, changed);
+	return true;
+}
+
 static void qubes_output_damage(struct qubes_output *output,
-                                const struct wlr_output_state *state)
+                                const struct wlr_output_state *state,
+                                struct wlr_buffer *previous)
 {
 	pixman_box32_t fake_rect = {
 		.x1 = 0, .y1 = 0, .x2 = output->guest.width, .y2 = output->guest.height
 	};
+	pixman_box32_t merged_rects[QUBES_DAMAGE_MAX_RECTS];
 	pixman_box32_t *rects;
+	pixman_region32_t changed;
 	int n_rects;
+	pixman_region32_init(&changed);
 	if (state == NULL || (output->flags & QUBES_OUTPUT_DAMAGE_ALL) ||
-		 (state->committed & WLR_OUTPUT_STATE_MODE) ||
-		 (output->magic != QUBES_VIEW_MAGIC)) {
+		 (state->committed & WLR_OUTPUT_STATE_MODE)) {
 		wlr_log(WLR_DEBUG, "Damaging everything");
 		n_rects = 1;
 		rects = &fake_rect;
 		output->flags &= ~QUBES_OUTPUT_DAMAGE_ALL;
 	} else if (!(state->committed & WLR_OUTPUT_STATE_DAMAGE)) {
-		return;
+		goto out;
 	} else {
 		n_rects = 0;
 		rects = pixman_region32_rectangles((pixman_region32_t *)&state->damage,
 		                                   &n_rects);
 		if (n_rects <= 0 || !rects) {
 			wlr_log(WLR_DEBUG, "No damage!");
-			return;
+			goto out;
 		}
 	}
+	output->damage_stats.rects += (uint64_t)n_rects;
+	uint64_t pixels_in = 0;
+	for (int i = 0; i < n_rects; ++i)
+		if (rects[i].x2 > rects[i].x1 && rects[i].y2 > rects[i].y1)
+			pixels_in += (uint64_t)qubes_box_area(&rects[i]);
+	output->damage_stats.pixels_in += pixels_in;
+	if (rects != &fake_rect &&
+	    qubes_output_diff_damage(output, previous, &state->damage, &changed)) {
+		rects = pixman_region32_rectangles(&changed, &n_rects);
+		uint64_t pixels_changed = 0;
+		for (int i = 0; i < n_rects; ++i)
+			pixels_changed += (uint64_t)qubes_box_area(&rects[i]);
+		output->damage_stats.diff_saved +=
+		   (pixels_in - pixels_changed) * sizeof(uint32_t);
+	}
+	if (n_rects > 1 && output->server->damage_message_cost) {
+		n_rects = qubes_damage_coalesce(
+		   rects, n_rects, output->server->damage_message_cost, merged_rects);
+		rects = merged_rects;
+	}
 	for (int i = 0; i < n_rects; ++i) {
 		int32_t width, height;
 		if (__builtin_sub_overflow(rects[i].x2, rects[i].x1, &width) ||
 		    __builtin_sub_overflow(rects[i].y2, rects[i].y1, &height)) {
 			wlr_log(WLR_ERROR, "Overflow in damage calc");
-			return;
+			goto out;
 		}
 		if (width <= 0 || height <= 0) {
 			wlr_log(WLR_ERROR, "Negative width or height - skipping");
@@ -130,11 +185,204 @@ static void qubes_output_damage(struct qubes_output *output,
 		// Created above
 		qubes_rust_send_message(output->server->backend->rust_backend,
 		                        (struct msg_hdr *)&new_msg);
+		output->damage_stats.messages++;
+		output->damage_stats.pixels_out += (uint64_t)width * (uint64_t)height;
 	}
+out:
+	pixman_region32_fini(&changed);
 }
 
-void qubes_output_dump_buffer(struct qubes_output *output,
-                              const struct wlr_output_state *state)
+static uint64_t qubes_output_monotonic_ns(void)
+{
+	struct timespec now;
+	assert(clock_gettime(CLOCK_MONOTONIC, &now) == 0);
+	return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+
+/* Exponentially weighted moving average with weight 1/8 */
+static void qubes_output_average(uint32_t *average, uint64_t sample_ns)
+{
+	const int64_t sample = (int64_t)QUBES_MIN(sample_ns / 1000, UINT32_MAX);
+	if (*average == 0)
+		*average = (uint32_t)sample;
+	else
+		*average = (uint32_t)((int64_t)*average + (sample - *average) / 8);
+}
+
+static uint32_t qubes_output_trim_swapchain(struct qubes_output *output,
+                                            unsigned int keep);
+static uint32_t qubes_output_replace_swapchain(struct qubes_output *output);
+
+/*
+ * Reports the given commit to wp_presentation clients.  The refresh interval
+ * is that of the frame timer, and since frame ticks are aligned to multiples
+ * of it, the number of intervals since the epoch serves as the retrace
+ * counter.
+ */
+static void qubes_output_send_present(struct qubes_output *output,
+                                      uint32_t commit_seq, bool presented,
+                                      uint64_t when_ns)
+{
+	uint64_t const interval = output->server->frame_clock.interval_ns;
+	struct timespec when = {
+		.tv_sec = (time_t)(when_ns / 1000000000),
+		.tv_nsec = (long)(when_ns % 1000000000),
+	};
+	struct wlr_output_event_present event = {
+		.commit_seq = commit_seq,
+		.presented = presented,
+		.when = presented ? &when : NULL,
+		.seq = (unsigned)(when_ns / interval),
+		.refresh = (int)interval,
+		/* The time is when the ACK arrived, not a hardware completion
+		 * event, and the daemon is not synced to any retrace */
+		.flags = 0,
+	};
+	wlr_output_send_present(&output->output, &event);
+}
+
+static void qubes_output_present_idle(void *data)
+{
+	struct qubes_output *output = data;
+
+	output->present_idle = NULL; /* idle sources are one-shot */
+	qubes_output_send_present(output, output->present_seq, true,
+	                          qubes_output_monotonic_ns());
+}
+
+/*
+ * Daemons older than protocol 1.7 never acknowledge dumps, so the commit
+ * counts as presented once it is complete.  Not from within the commit
+ * itself: wlroots only matches presentation feedback to a commit after the
+ * backend has accepted it.
+ */
+static void qubes_output_defer_present(struct qubes_output *output)
+{
+	output->present_seq = output->output.commit_seq + 1;
+	if (output->present_idle)
+		return;
+	struct wl_event_loop *loop =
+	   wl_display_get_event_loop(output->server->wl_display);
+	output->present_idle =
+	   wl_event_loop_add_idle(loop, qubes_output_present_idle, output);
+}
+
+/*
+ * Chooses between double and triple buffering.  With double buffering, the
+ * buffer that was just dumped is rendered to again on the next frame, so if
+ * the daemon usually has not acknowledged it by then, the window should get
+ * a third buffer.  Windows that redraw rarely compared to the acknowledgement
+ * latency go back to two.
+ */
+static void qubes_output_update_depth(struct qubes_output *output)
+{
+	const uint64_t latency = output->swap.ack_latency_us;
+	const uint64_t interval = output->swap.interval_us;
+
+	if (latency == 0 || interval == 0)
+		return;
+	if (output->swap.depth < 3 && latency * 4 > interval * 3) {
+		output->swap.depth = 3;
+		output->swap.grows++;
+		qubes_window_log(output, WLR_DEBUG,
+		                 "Triple buffering: ACK latency %" PRIu64
+		                 " us, frame interval %" PRIu64 " us",
+		                 latency, interval);
+	} else if (output->swap.depth > 2 && latency * 2 < interval) {
+		output->swap.depth = 2;
+		output->swap.shrinks++;
+		qubes_window_log(output, WLR_DEBUG,
+		                 "Double buffering: ACK latency %" PRIu64
+		                 " us, frame interval %" PRIu64 " us",
+		                 latency, interval);
+	}
+}
+
+static int qubes_output_reclaim_buffers(void *data);
+static void qubes_output_schedule_tick(struct qubes_output *output);
+
+static struct qubes_output *qubes_output_dump_owner(struct tinywl_server *server,
+                                                    struct qubes_link *link)
+{
+	struct qubes_output *output;
+	wl_list_for_each (output, &server->views, link) {
+		if (output->window_id == link->window_id)
+			return output;
+	}
+	return NULL;
+}
+
+/*
+ * With double buffering, a window may only draw once the daemon has ACKed its
+ * previous dump; triple buffering allows one more dump in flight.
+ */
+static bool qubes_output_ack_pending(struct qubes_output *output)
+{
+	return output->swap.outstanding >= output->swap.depth - 1;
+}
+
+/* Frees the link.  output is NULL if the window is gone. */
+static void qubes_output_release_dump(struct qubes_output *output,
+                                      struct qubes_link *link)
+{
+	if (output) {
+		assert(output->swap.outstanding > 0);
+		output->swap.outstanding--;
+		if (link->held)
+			output->swap.dump_held = false;
+	}
+	if (link->held)
+		wlr_buffer_unlock(&link->buffer->inner);
+	wlr_buffer_unlock(link->client_buffer);
+	qubes_buffer_destroy(&link->buffer->inner);
+	free(link);
+	if (!output)
+		return;
+	/* The frame events held back by qubes_output_frame_tick() */
+	if (output->swap.ack_wait && !qubes_output_ack_pending(output)) {
+		output->swap.ack_wait = false;
+		qubes_output_schedule_tick(output);
+	}
+}
+
+void qubes_output_dump_acked(struct tinywl_server *server,
+                             struct qubes_link *link)
+{
+	struct qubes_output *output = qubes_output_dump_owner(server, link);
+	if (output) {
+		uint64_t const now = qubes_output_monotonic_ns();
+		output->swap.acks++;
+		qubes_output_average(&output->swap.ack_latency_us, now - link->sent_ns);
+		if (link->present)
+			qubes_output_send_present(output, link->commit_seq, true, now);
+		qubes_output_update_depth(output);
+		/* Not done in qubes_output_update_depth(), which can be called
+		 * in the middle of a commit */
+		if (output->swap.depth == 2)
+			qubes_output_trim_swapchain(output, 2);
+	}
+	qubes_output_release_dump(output, link);
+	if (output && (output->flags & QUBES_OUTPUT_RECLAIM_DUE))
+		qubes_output_reclaim_buffers(output);
+}
+
+void qubes_output_drop_dumps(struct tinywl_server *server)
+{
+	struct qubes_link *link;
+
+	while ((link = server->queue_head) != NULL) {
+		struct qubes_output *output = qubes_output_dump_owner(server, link);
+		server->queue_head = link->next;
+		if (output && link->present)
+			qubes_output_send_present(output, link->commit_seq, false, 0);
+		qubes_output_release_dump(output, link);
+	}
+	server->queue_tail = NULL;
+}
+
+static void qubes_output_dump_buffer_diff(struct qubes_output *output,
+                                          const struct wlr_output_state *state,
+                                          struct wlr_buffer *previous)
 {
 	assert(output->buffer->impl == qubes_buffer_impl_addr);
 	struct tinywl_server *server = output->server;
@@ -150,6 +398,31 @@ void qubes_output_dump_buffer(struct qubes_output *output,
 		buffer->refcount++;
 		link->next = NULL;
 		link->buffer = buffer;
+		/* The daemon shows the client's own pages, so the client must
+		 * not draw into them until the daemon is done with them */
+		if ((link->client_buffer = qubes_buffer_import_source(&buffer->inner)))
+			wlr_buffer_lock(link->client_buffer);
+		link->window_id = output->window_id;
+		/* The commit calling this has not been counted yet */
+		link->commit_seq = output->output.commit_seq + 1;
+		link->present = state != NULL;
+		link->sent_ns = qubes_output_monotonic_ns();
+		if (output->swap.last_dump_ns)
+			qubes_output_average(&output->swap.interval_us,
+			                     link->sent_ns - output->swap.last_dump_ns);
+		output->swap.last_dump_ns = link->sent_ns;
+		output->swap.dumps++;
+		output->swap.outstanding++;
+		output->swap.outstanding_peak =
+		   QUBES_MAX(output->swap.outstanding_peak, output->swap.outstanding);
+		qubes_output_update_depth(output);
+		/* Keep one dumped buffer out of the swapchain's reach until the
+		 * daemon is done with it, so that a third buffer gets allocated */
+		link->held = output->swap.depth > 2 && !output->swap.dump_held;
+		if (link->held) {
+			wlr_buffer_lock(&buffer->inner);
+			output->swap.dump_held = true;
+		}
 		if (server->queue_tail) {
 			assert(server->queue_head != NULL);
 			server->queue_tail->next = link;
@@ -158,6 +431,8 @@ void qubes_output_dump_buffer(struct qubes_output *output,
 			server->queue_head = link;
 		}
 		output->server->queue_tail = link;
+	} else if (state) {
+		qubes_output_defer_present(output);
 	}
 	buffer->header.window = output->window_id;
 	buffer->header.type = MSG_WINDOW_DUMP;
@@ -165,7 +440,13 @@ void qubes_output_dump_buffer(struct qubes_output *output,
 	   sizeof(buffer->qubes) + NUM_PAGES(buffer->size) * SIZEOF_GRANT_REF;
 	qubes_rust_send_message(output->server->backend->rust_backend,
 	                        &buffer->header);
-	qubes_output_damage(output, state);
+	qubes_output_damage(output, state, previous);
+}
+
+void qubes_output_dump_buffer(struct qubes_output *output,
+                              const struct wlr_output_state *state)
+{
+	qubes_output_dump_buffer_diff(output, state, NULL);
 }
 
 bool qubes_output_ensure_created(struct qubes_output *output)
@@ -224,6 +505,9 @@ static bool qubes_output_commit(struct wlr_output *raw_output,
 	if (!qubes_output_ensure_created(output))
 		return false;
 
+	/* Everything this commit sends goes to the vchan in one write */
+	void *const rust_backend = output->server->backend->rust_backend;
+	qubes_rust_begin_batch(rust_backend);
 	if (state->committed & WLR_OUTPUT_STATE_MODE) {
 		assert(state->mode_type == WLR_OUTPUT_STATE_MODE_CUSTOM);
 		assert(state->custom_mode.width > 0);
@@ -239,18 +523,31 @@ static bool qubes_output_commit(struct wlr_output *raw_output,
 
 	if ((state->committed & WLR_OUTPUT_STATE_BUFFER) &&
 	    (output->buffer != state->buffer)) {
-		if (output->buffer) {
+		/* Kept until the new buffer has been compared against it */
+		struct wlr_buffer *previous = output->buffer;
+		struct wlr_buffer *previous_client = output->client_buffer;
+		if (previous)
 			wl_list_remove(&output->buffer_destroy.link);
-			wlr_buffer_unlock(output->buffer);
-		}
 
+		output->client_buffer = NULL;
 		if ((output->buffer = state->buffer)) {
 			wlr_buffer_lock(output->buffer);
 			wl_signal_add(&output->buffer->events.destroy,
 			              &output->buffer_destroy);
-			qubes_output_dump_buffer(output, state);
+			/* The daemon shows the client's own pages, so the client
+			 * must not draw into them until they are replaced.  With
+			 * DUMP_ACKs, the dump holds them instead, until it is
+			 * ACKed. */
+			if (output->server->backend->protocol_version < 0x10007 &&
+			    (output->client_buffer =
+			        qubes_buffer_import_source(output->buffer)))
+				wlr_buffer_lock(output->client_buffer);
+			qubes_output_dump_buffer_diff(output, state, previous);
 		}
+		wlr_buffer_unlock(previous);
+		wlr_buffer_unlock(previous_client);
 	}
+	qubes_rust_end_batch(rust_backend);
 	return true;
 }
 
@@ -296,51 +593,1171 @@ static const struct wlr_output_impl qubes_wlr_output_impl = {
 	.get_primary_formats = qubes_output_get_primary_formats,
 };
 
-static bool qubes_wlr_scene_output_commit(
-   struct wlr_scene_output *scene_output,
-   uint32_t width, uint32_t height, uint32_t fps)
+struct qubes_sole_buffer {
+	struct wlr_scene_buffer *buffer;
+	unsigned int count;
+	int x, y;
+};
+
+static void qubes_output_find_buffer(struct wlr_scene_buffer *buffer, int sx,
+                                     int sy, void *data)
 {
-	if (!scene_output->output->needs_frame &&
-	    !pixman_region32_not_empty(&scene_output->damage_ring.current)) {
-		return true;
+	struct qubes_sole_buffer *sole = data;
+	if (sole->count++ == 0) {
+		sole->buffer = buffer;
+		sole->x = sx;
+		sole->y = sy;
 	}
+}
 
-	bool ok = false;
-	struct wlr_output_state state;
-	wlr_output_state_init(&state);
-	wlr_output_state_set_custom_mode(&state, width, height, fps);
-	if (!wlr_scene_output_build_state(scene_output, &state, NULL)) {
-		goto out;
+/*
+ * Returns the scene's buffer if it is the only one and covers the output
+ * exactly without scaling, cropping, or blending, so that compositing the
+ * scene would just reproduce it.  Anything else, such as subsurfaces or
+ * popups, needs Pixman.
+ */
+static struct wlr_scene_buffer *
+qubes_output_sole_buffer(struct qubes_output *output, uint32_t width,
+                         uint32_t height)
+{
+	struct wlr_scene_output *scene_output = output->scene_output;
+	struct qubes_sole_buffer sole = { 0 };
+
+	wlr_scene_node_for_each_buffer(&scene_output->scene->tree.node,
+	                               qubes_output_find_buffer, &sole);
+	if (sole.count != 1 || !sole.buffer->buffer)
+		return NULL;
+	struct wlr_scene_buffer *scene_buffer = sole.buffer;
+	struct wlr_buffer *client = scene_buffer->buffer;
+	if (sole.x != scene_output->x || sole.y != scene_output->y ||
+	    client->width != (int)width || client->height != (int)height ||
+	    scene_buffer->transform != WL_OUTPUT_TRANSFORM_NORMAL ||
+	    !wlr_fbox_empty(&scene_buffer->src_box) ||
+	    (scene_buffer->dst_width &&
+	     scene_buffer->dst_width != client->width) ||
+	    (scene_buffer->dst_height &&
+	     scene_buffer->dst_height != client->height) ||
+	    scene_buffer->opacity != 1.0f)
+		return NULL;
+	return scene_buffer;
+}
+
+/* What wlr_scene_output_build_state() would have done, so that the surface
+ * gets presentation feedback */
+static void qubes_output_sample_buffer(struct qubes_output *output,
+                                       struct wlr_scene_buffer *scene_buffer,
+                                       bool direct_scanout)
+{
+	struct wlr_scene_output_sample_event sample = {
+		.output = output->scene_output,
+		.direct_scanout = direct_scanout,
+	};
+	wl_signal_emit_mutable(&scene_buffer->events.output_sample, &sample);
+}
+
+/*
+ * Zero-copy path.  The pages of the sole client buffer are granted to the
+ * daemon and dumped as they are.  Formats and layouts that
+ * qubes_allocator_import() refuses take the direct-copy path instead.
+ */
+static bool qubes_output_build_zero_copy(struct qubes_output *output,
+                                         struct wlr_output_state *state,
+                                         struct wlr_scene_buffer *scene_buffer)
+{
+	struct wlr_buffer *buffer =
+	   qubes_allocator_import(output->server->allocator, scene_buffer->buffer);
+	if (!buffer)
+		return false;
+	wlr_output_state_set_buffer(state, buffer);
+	wlr_output_state_set_damage(state,
+	                            &output->scene_output->damage_ring.current);
+	qubes_output_sample_buffer(output, scene_buffer, true);
+	output->zero_copy_frames++;
+	return true;
+}
+
+/* The buffer with the client's pixels behind a scene buffer, or NULL */
+static struct wlr_buffer *
+qubes_output_buffer_source(struct wlr_scene_buffer *scene_buffer)
+{
+	struct wlr_client_buffer *client_buffer =
+	   wlr_client_buffer_get(scene_buffer->buffer);
+	return client_buffer ? client_buffer->source : scene_buffer->buffer;
+}
+
+/*
+ * On resize, copies the part of the last dumped frame that the new size
+ * still covers into buffer, and stores in damage what is left to draw: the
+ * newly exposed strips and whatever the scene damaged since that frame.
+ * This only saves rendering: the daemon does not keep the contents of a
+ * resized window, so the whole buffer is still sent to it, see
+ * qubes_output_damage().  Returns false if the old frame cannot be used.
+ */
+static bool qubes_output_keep_contents(struct qubes_output *output,
+                                       struct wlr_buffer *buffer,
+                                       pixman_region32_t *damage)
+{
+	const struct wlr_damage_ring *ring = &output->scene_output->damage_ring;
+	struct wlr_buffer *previous = output->buffer;
+	void *src_data, *dst_data;
+	uint32_t src_format, dst_format;
+	size_t src_stride, dst_stride;
+	pixman_region32_t kept;
+
+	/* The damage ring still has the bounds of the previous frame */
+	if (!previous || previous->width != ring->width ||
+	    previous->height != ring->height)
+		return false;
+	if (!wlr_buffer_begin_data_ptr_access(previous,
+	                                      WLR_BUFFER_DATA_PTR_ACCESS_READ,
+	                                      &src_data, &src_format, &src_stride))
+		return false;
+	if (!wlr_buffer_begin_data_ptr_access(buffer,
+	                                      WLR_BUFFER_DATA_PTR_ACCESS_WRITE,
+	                                      &dst_data, &dst_format,
+	                                      &dst_stride)) {
+		wlr_buffer_end_data_ptr_access(previous);
+		return false;
 	}
+	const uint32_t width = (uint32_t)QUBES_MIN(previous->width, buffer->width);
+	const uint32_t height =
+	   (uint32_t)QUBES_MIN(previous->height, buffer->height);
+	pixman_region32_init_rect(&kept, 0, 0, width, height);
+	output->resize_kept_bytes += qubes_pixel_copy(
+	   dst_data, dst_stride, src_data, src_stride, width, height, &kept);
+	wlr_buffer_end_data_ptr_access(buffer);
+	wlr_buffer_end_data_ptr_access(previous);
 
-	ok = wlr_output_commit_state(scene_output->output, &state);
-	if (!ok) {
+	pixman_region32_union_rect(damage, damage, 0, 0, (unsigned)buffer->width,
+	                           (unsigned)buffer->height);
+	pixman_region32_subtract(damage, damage, &kept);
+	pixman_region32_union(damage, damage, &ring->current);
+	pixman_region32_fini(&kept);
+	return true;
+}
+
+/*
+ * Takes a buffer from the swapchain for rendering into without the renderer,
+ * stores in damage the part of it that is out of date, and sets the damage
+ * of the state.  kept is set if the contents of the previous frame were
+ * kept across a resize, in which case qubes_output_kept_contents() is to be
+ * called if the frame is committed.  Returns a locked buffer, or NULL on
+ * failure.
+ */
+static struct wlr_buffer *
+qubes_output_acquire_buffer(struct qubes_output *output,
+                            struct wlr_output_state *state,
+                            pixman_region32_t *damage, bool *kept)
+{
+	struct wlr_scene_output *scene_output = output->scene_output;
+	struct wlr_output *raw_output = scene_output->output;
+	struct wlr_damage_ring *ring = &scene_output->damage_ring;
+	int age = -1;
+
+	if (!wlr_output_configure_primary_swapchain(raw_output, state,
+	                                            &raw_output->swapchain))
+		return NULL;
+	struct wlr_buffer *buffer =
+	   wlr_swapchain_acquire(raw_output->swapchain, &age);
+	if (!buffer)
+		return NULL;
+	*kept = false;
+	if (buffer->width == ring->width && buffer->height == ring->height) {
+		wlr_damage_ring_get_buffer_damage(ring, age, damage);
+		wlr_output_state_set_damage(state, &ring->current);
+	} else if ((*kept = qubes_output_keep_contents(output, buffer, damage))) {
+		wlr_output_state_set_damage(state, damage);
+	} else {
+		/* The ring's bounds are those of the old size, so a fresh buffer
+		 * would only be drawn that far */
+		pixman_region32_union_rect(damage, damage, 0, 0,
+		                           (unsigned)buffer->width,
+		                           (unsigned)buffer->height);
+		wlr_output_state_set_damage(state, &ring->current);
+	}
+	return buffer;
+}
+
+/* Counts a resize that was drawn on top of the previous frame */
+static void qubes_output_kept_contents(struct qubes_output *output)
+{
+	output->resizes_kept++;
+}
+
+/*
+ * Direct-copy path.  The damage of the sole client buffer, accumulated over
+ * the age of the swapchain buffer, is copied straight into it, so the
+ * renderer never runs.  This gives the same pixels as compositing the scene.
+ */
+static bool
+qubes_output_build_direct_copy(struct qubes_output *output,
+                               struct wlr_output_state *state,
+                               struct wlr_scene_buffer *scene_buffer)
+{
+	struct wlr_buffer *source = qubes_output_buffer_source(scene_buffer);
+	void *src_data, *dst_data;
+	uint32_t src_format, dst_format;
+	size_t src_stride, dst_stride;
+	pixman_region32_t damage;
+	bool ok = false, kept;
+
+	if (!source)
+		return false;
+	pixman_region32_init(&damage);
+	struct wlr_buffer *buffer =
+	   qubes_output_acquire_buffer(output, state, &damage, &kept);
+	if (!buffer)
 		goto out;
+	if (!wlr_buffer_begin_data_ptr_access(source,
+	                                      WLR_BUFFER_DATA_PTR_ACCESS_READ,
+	                                      &src_data, &src_format, &src_stride))
+		goto unlock;
+	if ((src_format != DRM_FORMAT_XRGB8888 &&
+	     src_format != DRM_FORMAT_ARGB8888) ||
+	    !wlr_buffer_begin_data_ptr_access(buffer,
+	                                      WLR_BUFFER_DATA_PTR_ACCESS_WRITE,
+	                                      &dst_data, &dst_format, &dst_stride))
+		goto end_source;
+
+	output->direct_copy_bytes +=
+	   qubes_pixel_copy(dst_data, dst_stride, src_data, src_stride,
+	                    (uint32_t)buffer->width, (uint32_t)buffer->height,
+	                    &damage);
+	wlr_buffer_end_data_ptr_access(buffer);
+
+	wlr_output_state_set_buffer(state, buffer);
+	qubes_output_sample_buffer(output, scene_buffer, false);
+	if (kept)
+		qubes_output_kept_contents(output);
+	output->direct_copy_frames++;
+	ok = true;
+end_source:
+	wlr_buffer_end_data_ptr_access(source);
+unlock:
+	wlr_buffer_unlock(buffer);
+out:
+	pixman_region32_fini(&damage);
+	return ok;
+}
+
+/* Damage is composited in tiles of this many pixels square, one per job */
+#define QUBES_RENDER_TILE 256
+/* Scenes with more buffers than this are left to the renderer */
+#define QUBES_RENDER_MAX_LAYERS 16
+
+/* A scene buffer as seen by qubes_output_render_tile() */
+struct qubes_render_layer {
+	struct wlr_scene_buffer *scene_buffer;
+	struct wlr_buffer *source;
+	void *data;
+	size_t stride;
+	pixman_format_code_t format;
+	int32_t x, y, width, height; /* in output coordinates */
+};
+
+/*
+ * Shared read-only by the jobs compositing one frame, between
+ * qubes_output_prepare_parallel() and qubes_output_finish_parallel()
+ */
+struct qubes_render_frame {
+	struct qubes_render_layer layers[QUBES_RENDER_MAX_LAYERS];
+	unsigned int n_layers;
+	bool failed;
+	/* Tiles run on the render pool, so layers must not be client shm
+	 * pools that can shrink, see qubes_buffer_may_shrink() */
+	bool threaded;
+	/* layers[0] covers the whole output, so no background is needed */
+	bool covered;
+	int32_t scene_x, scene_y;
+	struct wlr_buffer *buffer; /* locked, with write access */
+	void *data;
+	size_t stride;
+	int32_t width, height;
+	uint32_t tiles_x, n_tiles;
+	/* Index of the first tile in a batch, see qubes_output_render_batch() */
+	uint32_t first_tile;
+	pixman_region32_t damage;
+	bool kept; /* see qubes_output_acquire_buffer() */
+};
+
+static void qubes_output_add_layer(struct wlr_scene_buffer *scene_buffer,
+                                   int sx, int sy, void *data)
+{
+	struct qubes_render_frame *frame = data;
+	struct wlr_buffer *buffer = scene_buffer->buffer;
+
+	if (frame->failed || !buffer)
+		return;
+	/* Pixman could do these, but the renderer already knows how */
+	if (frame->n_layers == QUBES_RENDER_MAX_LAYERS ||
+	    scene_buffer->transform != WL_OUTPUT_TRANSFORM_NORMAL ||
+	    !wlr_fbox_empty(&scene_buffer->src_box) ||
+	    (scene_buffer->dst_width && scene_buffer->dst_width != buffer->width) ||
+	    (scene_buffer->dst_height &&
+	     scene_buffer->dst_height != buffer->height) ||
+	    scene_buffer->opacity != 1.0f) {
+		frame->failed = true;
+		return;
 	}
+	struct qubes_render_layer *layer = frame->layers + frame->n_layers;
+	uint32_t format;
+	if (!(layer->source = qubes_output_buffer_source(scene_buffer)) ||
+	    (frame->threaded && qubes_buffer_may_shrink(layer->source)) ||
+	    !wlr_buffer_begin_data_ptr_access(layer->source,
+	                                      WLR_BUFFER_DATA_PTR_ACCESS_READ,
+	                                      &layer->data, &format,
+	                                      &layer->stride)) {
+		frame->failed = true;
+		return;
+	}
+	frame->n_layers++;
+	switch (format) {
+	case DRM_FORMAT_XRGB8888:
+		layer->format = PIXMAN_x8r8g8b8;
+		break;
+	case DRM_FORMAT_ARGB8888:
+		layer->format = PIXMAN_a8r8g8b8;
+		break;
+	default:
+		frame->failed = true;
+		return;
+	}
+	layer->scene_buffer = scene_buffer;
+	layer->x = sx - frame->scene_x;
+	layer->y = sy - frame->scene_y;
+	layer->width = buffer->width;
+	layer->height = buffer->height;
+}
 
-	wlr_damage_ring_rotate(&scene_output->damage_ring);
+/*
+ * Composites the damage within one tile, like the Pixman renderer would:
+ * the layers from bottom to top over a black background.  Runs on a worker
+ * thread, so it only touches pixels and its own Pixman images; sharing
+ * images between threads is not safe, as Pixman updates them lazily.
+ */
+static void qubes_output_render_tile(void *data, unsigned int index)
+{
+	const struct qubes_render_frame *frame = data;
+	const int32_t tile = QUBES_RENDER_TILE;
+	const pixman_color_t black = { 0, 0, 0, 0xFFFF };
+	pixman_image_t *src[QUBES_RENDER_MAX_LAYERS] = { 0 };
+	pixman_image_t *dst = NULL;
+	pixman_region32_t clip;
+	int n_rects = 0;
 
+	pixman_region32_init_rect(&clip, (int32_t)(index % frame->tiles_x) * tile,
+	                          (int32_t)(index / frame->tiles_x) * tile,
+	                          (unsigned)tile, (unsigned)tile);
+	pixman_region32_intersect(&clip, &clip,
+	                          (pixman_region32_t *)&frame->damage);
+	if (!pixman_region32_not_empty(&clip))
+		goto out;
+	if (!(dst = pixman_image_create_bits_no_clear(
+	         PIXMAN_x8r8g8b8, frame->width, frame->height, frame->data,
+	         (int)frame->stride)))
+		goto out;
+	for (unsigned int i = 0; i < frame->n_layers; ++i) {
+		const struct qubes_render_layer *layer = frame->layers + i;
+		if (!(src[i] = pixman_image_create_bits_no_clear(
+		         layer->format, layer->width, layer->height, layer->data,
+		         (int)layer->stride)))
+			goto out;
+	}
+	const pixman_box32_t *rects = pixman_region32_rectangles(&clip, &n_rects);
+	for (int r = 0; r < n_rects; ++r) {
+		const pixman_box32_t *rect = rects + r;
+		if (!frame->covered)
+			pixman_image_fill_boxes(PIXMAN_OP_SRC, dst, &black, 1, rect);
+		for (unsigned int i = 0; i < frame->n_layers; ++i) {
+			const struct qubes_render_layer *layer = frame->layers + i;
+			const int32_t x1 = QUBES_MAX(rect->x1, layer->x);
+			const int32_t y1 = QUBES_MAX(rect->y1, layer->y);
+			const int32_t x2 = QUBES_MIN(rect->x2, layer->x + layer->width);
+			const int32_t y2 = QUBES_MIN(rect->y2, layer->y + layer->height);
+			if (x1 >= x2 || y1 >= y2)
+				continue;
+			pixman_image_composite32(
+			   i == 0 && frame->covered ? PIXMAN_OP_SRC : PIXMAN_OP_OVER,
+			   src[i], NULL, dst, x1 - layer->x, y1 - layer->y, 0, 0, x1, y1,
+			   x2 - x1, y2 - y1);
+		}
+	}
 out:
-	wlr_output_state_finish(&state);
+	for (unsigned int i = 0; i < frame->n_layers; ++i)
+		if (src[i])
+			pixman_image_unref(src[i]);
+	if (dst)
+		pixman_image_unref(dst);
+	pixman_region32_fini(&clip);
+}
+
+static void qubes_output_free_frame(struct qubes_render_frame *frame)
+{
+	for (unsigned int i = 0; i < frame->n_layers; ++i)
+		wlr_buffer_end_data_ptr_access(frame->layers[i].source);
+	if (frame->buffer) {
+		wlr_buffer_end_data_ptr_access(frame->buffer);
+		wlr_buffer_unlock(frame->buffer);
+	}
+	pixman_region32_fini(&frame->damage);
+	free(frame);
+}
+
+/*
+ * Tile-parallel path.  The damage accumulated over the age of the swapchain
+ * buffer is split into tiles, which are composited on the render pool and
+ * the main thread at once.  Scenes that need more than copying and blending,
+ * or whose clients could truncate their pixels under a worker, go to the
+ * renderer.  This only takes the buffers; the tiles are composited
+ * by qubes_output_render_frames(), which returns once every tile is done, so
+ * the buffer is complete before qubes_output_finish_parallel() puts it in
+ * the state to be committed and dumped.
+ */
+static struct qubes_render_frame *
+qubes_output_prepare_parallel(struct qubes_output *output,
+                              struct wlr_output_state *state, uint32_t width,
+                              uint32_t height)
+{
+	struct wlr_scene_output *scene_output = output->scene_output;
+	struct qubes_render_frame *frame;
+	uint32_t format;
+
+	if (!(frame = calloc(1, sizeof(*frame)))) {
+		wlr_log(WLR_ERROR, "calloc(3) failed");
+		return NULL;
+	}
+	pixman_region32_init(&frame->damage);
+	frame->scene_x = scene_output->x;
+	frame->scene_y = scene_output->y;
+	frame->threaded = output->server->render_pool != NULL;
+	wlr_scene_node_for_each_buffer(&scene_output->scene->tree.node,
+	                               qubes_output_add_layer, frame);
+	if (frame->failed)
+		goto fail;
+	frame->covered =
+	   frame->n_layers > 0 && frame->layers[0].x <= 0 &&
+	   frame->layers[0].y <= 0 &&
+	   frame->layers[0].x + frame->layers[0].width >= (int32_t)width &&
+	   frame->layers[0].y + frame->layers[0].height >= (int32_t)height;
+
+	struct wlr_buffer *buffer =
+	   qubes_output_acquire_buffer(output, state, &frame->damage, &frame->kept);
+	if (!buffer)
+		goto fail;
+	if (!wlr_buffer_begin_data_ptr_access(buffer,
+	                                      WLR_BUFFER_DATA_PTR_ACCESS_WRITE,
+	                                      &frame->data, &format,
+	                                      &frame->stride)) {
+		wlr_buffer_unlock(buffer);
+		goto fail;
+	}
+	frame->buffer = buffer;
+	frame->width = buffer->width;
+	frame->height = buffer->height;
+	const uint32_t tile = QUBES_RENDER_TILE;
+	frame->tiles_x = (width + tile - 1) / tile;
+	frame->n_tiles = frame->tiles_x * ((height + tile - 1) / tile);
+	return frame;
+fail:
+	qubes_output_free_frame(frame);
+	return NULL;
+}
+
+static void qubes_output_finish_parallel(struct qubes_output *output,
+                                         struct wlr_output_state *state,
+                                         struct qubes_render_frame *frame)
+{
+	wlr_output_state_set_buffer(state, frame->buffer);
+	if (frame->kept)
+		qubes_output_kept_contents(output);
+	for (unsigned int i = 0; i < frame->n_layers; ++i)
+		qubes_output_sample_buffer(output, frame->layers[i].scene_buffer, false);
+	output->parallel_frames++;
+	qubes_output_free_frame(frame);
+}
+
+/* Tiles of several frames, numbered one frame after the other */
+struct qubes_render_batch {
+	struct qubes_render_frame *const *frames;
+	unsigned int count;
+};
+
+static void qubes_output_render_batch_tile(void *data, unsigned int index)
+{
+	const struct qubes_render_batch *batch = data;
+	unsigned int i = batch->count - 1;
+
+	while (batch->frames[i]->first_tile > index)
+		--i;
+	qubes_output_render_tile(batch->frames[i],
+	                         index - batch->frames[i]->first_tile);
+}
+
+/*
+ * Composites the tiles of all the given frames as a single batch, so that a
+ * large window and a small one share the render pool instead of waiting for
+ * each other.  Returns once every tile is done.
+ */
+static void qubes_output_render_frames(struct qubes_render_pool *pool,
+                                       struct qubes_render_frame *const *frames,
+                                       unsigned int count)
+{
+	const struct qubes_render_batch batch = {
+		.frames = frames,
+		.count = count,
+	};
+	uint32_t tiles = 0;
+
+	if (count == 0)
+		return;
+	for (unsigned int i = 0; i < count; ++i) {
+		frames[i]->first_tile = tiles;
+		tiles += frames[i]->n_tiles;
+	}
+	qubes_render_pool_run(pool, qubes_output_render_batch_tile,
+	                      (void *)&batch, tiles);
+}
+
+/* Whether the output has something to draw, or a new refresh rate to
+ * commit, and is shown */
+static bool qubes_output_wants_frame(struct qubes_output *output)
+{
+	const pixman_region32_t *damage = &output->scene_output->damage_ring.current;
+
+	return !qubes_output_hidden(output) &&
+	       !(output->flags & QUBES_OUTPUT_RECLAIMED) &&
+	       (output->output.needs_frame || pixman_region32_not_empty(damage) ||
+	        output->output.refresh != (int32_t)output->server->refresh_mhz);
+}
+
+/*
+ * First half of drawing a frame: builds output->render_state.  With the
+ * render pool, the pixels may still have to be composited from
+ * output->render_frame.  Returns false on failure, in which case there is
+ * nothing to commit.
+ */
+static bool qubes_output_begin_frame(struct qubes_output *output,
+                                     uint32_t width, uint32_t height,
+                                     uint32_t fps)
+{
+	struct wlr_scene_output *scene_output = output->scene_output;
+	struct wlr_output_state *state = &output->render_state;
+	struct qubes_render_pool *pool = output->server->render_pool;
+
+	wlr_output_state_init(state);
+	wlr_output_state_set_custom_mode(state, width, height, fps);
+	/* Buffers are allocated (if needed) while building the state */
+	struct wlr_allocator *allocator = output->server->allocator;
+	if (output->server->window_arenas && !output->arena)
+		output->arena = qubes_arena_create(allocator);
+	output->render_first = output->swap.dumps == 0;
+	output->render_start = qubes_output_monotonic_ns();
+	struct wlr_scene_buffer *sole =
+	   qubes_output_sole_buffer(output, width, height);
+	bool built = sole && output->server->zero_copy &&
+	             qubes_output_build_zero_copy(output, state, sole);
+	if (!built) {
+		output->render_building = true;
+		qubes_allocator_set_size_hint(allocator, output->resize_reserve_pages);
+		qubes_allocator_set_arena(allocator, output->arena);
+		/*
+		 * With the pool, the copy of a sole buffer is spread over it too,
+		 * unless it is a client shm pool that could be truncated under a
+		 * worker: that one is copied here, on the main thread.  The
+		 * renderer cannot keep the old contents across a resize, so the
+		 * tile path is used for that even without the pool.
+		 */
+		const bool resizing =
+		   (int32_t)width != scene_output->damage_ring.width ||
+		   (int32_t)height != scene_output->damage_ring.height;
+		struct wlr_buffer *source =
+		   sole ? qubes_output_buffer_source(sole) : NULL;
+		const bool parallel =
+		   sole ? pool && source && !qubes_buffer_may_shrink(source)
+		        : pool || resizing;
+		if (parallel)
+			built = (output->render_frame = qubes_output_prepare_parallel(
+			            output, state, width, height)) != NULL;
+		else
+			built = sole && qubes_output_build_direct_copy(output, state, sole);
+		if (!built) {
+			/* A fresh buffer would only be drawn as far as the old size */
+			wlr_damage_ring_set_bounds(&scene_output->damage_ring,
+			                           (int32_t)width, (int32_t)height);
+			built = wlr_scene_output_build_state(scene_output, state, NULL);
+		}
+		qubes_allocator_set_arena(allocator, NULL);
+		qubes_allocator_set_size_hint(allocator, 0);
+		output->render_building = false;
+	}
+	if (!built)
+		wlr_output_state_finish(state);
+	return built;
+}
+
+/*
+ * Second half: commits output->render_state, which dumps the buffer to the
+ * GUI daemon.  The frame must have been composited by then.
+ */
+static bool qubes_output_end_frame(struct qubes_output *output)
+{
+	struct wlr_scene_output *scene_output = output->scene_output;
+	struct wlr_output_state *state = &output->render_state;
+
+	if (output->render_frame) {
+		qubes_output_finish_parallel(output, state, output->render_frame);
+		output->render_frame = NULL;
+	}
+	bool ok = wlr_output_commit_state(scene_output->output, state);
+	if (ok) {
+		wlr_damage_ring_rotate(&scene_output->damage_ring);
+		if (output->render_first && output->swap.dumps) {
+			output->first_frame_us = (uint32_t)(
+			   (qubes_output_monotonic_ns() - output->render_start) / 1000);
+			qubes_window_log(output, WLR_DEBUG,
+			                 "First frame took %" PRIu32 " us",
+			                 output->first_frame_us);
+		}
+	}
+	wlr_output_state_finish(state);
 	return ok;
 }
 
+static bool qubes_wlr_scene_output_commit(
+   struct qubes_output *output,
+   uint32_t width, uint32_t height, uint32_t fps)
+{
+	if (!qubes_output_begin_frame(output, width, height, fps))
+		return false;
+	if (output->render_frame)
+		qubes_output_render_frames(output->server->render_pool,
+		                           &output->render_frame, 1);
+	return qubes_output_end_frame(output);
+}
+
+/*
+ * Holds back further frames of this output until the next tick, which sends
+ * frame done events to its clients.  Only outputs that are scheduled this way
+ * are visited by qubes_output_frame_tick().
+ */
+static void qubes_output_schedule_tick(struct qubes_output *output)
+{
+	struct tinywl_server *server = output->server;
+
+	output->output.frame_pending = true;
+	if (wl_list_empty(&output->frame_link))
+		wl_list_insert(server->frame_outputs.prev, &output->frame_link);
+	qubes_frame_clock_schedule(&server->frame_clock);
+}
+
+static void qubes_output_send_frame_done(struct wlr_scene_buffer *buffer,
+                                         int sx __attribute__((unused)),
+                                         int sy __attribute__((unused)),
+                                         void *data)
+{
+	wlr_scene_buffer_send_frame_done(buffer, data);
+}
+
+static int qubes_output_hidden_frame(void *data)
+{
+	struct qubes_output *output = data;
+	struct timespec now;
+
+	output->hidden_frame_armed = false;
+	if (!qubes_output_hidden(output))
+		return 0;
+	output->output.needs_frame = false;
+	assert(clock_gettime(CLOCK_MONOTONIC, &now) == 0);
+	wlr_scene_node_for_each_buffer(&output->scene_output->scene->tree.node,
+	                               qubes_output_send_frame_done, &now);
+	return 0;
+}
+
+/*
+ * Nothing is rendered for a hidden window, but its clients still get a frame
+ * done event every hidden_frame_ms (if they ask for one), so that they keep
+ * running at a crawl instead of at the refresh rate.
+ */
+static void qubes_output_throttle_frame(struct qubes_output *output)
+{
+	int32_t const ms = output->server->hidden_frame_ms;
+
+	/* Otherwise the client waits until the window is shown again */
+	if (ms < 0 || output->hidden_frame_armed)
+		return;
+	if (!output->hidden_frame_timer) {
+		struct wl_event_loop *loop =
+		   wl_display_get_event_loop(output->server->wl_display);
+		output->hidden_frame_timer =
+		   wl_event_loop_add_timer(loop, qubes_output_hidden_frame, output);
+		if (!output->hidden_frame_timer)
+			return;
+	}
+	/* 0 would disarm the timer */
+	wl_event_source_timer_update(output->hidden_frame_timer, QUBES_MAX(ms, 1));
+	output->hidden_frame_armed = true;
+}
+
+/*
+ * Idle callback drawing the frames queued by qubes_output_queue_frame().
+ * Every frame is built first, then the tiles of all of them are composited
+ * on the render pool at once, and then they are committed one by one in the
+ * order they were asked for, so that the messages to the GUI daemon go out
+ * in a deterministic order from the main thread.
+ */
+static void qubes_output_render_batch(void *data)
+{
+	struct tinywl_server *server = data;
+	struct qubes_render_frame **frames;
+	struct qubes_output *output;
+	unsigned int count = 0;
+	struct wl_list batch;
+
+	server->render_idle = NULL;
+	wl_list_init(&batch);
+	wl_list_insert_list(&batch, &server->render_outputs);
+	wl_list_init(&server->render_outputs);
+	frames = calloc((size_t)wl_list_length(&batch), sizeof(*frames));
+	wl_list_for_each (output, &batch, render_link) {
+		/* Things may have changed since the frame was asked for */
+		output->render_staged =
+		   qubes_output_wants_frame(output) &&
+		   qubes_output_begin_frame(output, output->guest.width,
+		                            output->guest.height,
+		                            server->refresh_mhz);
+		if (!output->render_frame)
+			continue;
+		if (frames)
+			frames[count++] = output->render_frame;
+		else
+			qubes_output_render_frames(server->render_pool,
+			                           &output->render_frame, 1);
+	}
+	qubes_output_render_frames(server->render_pool, frames, count);
+	free(frames);
+	while (!wl_list_empty(&batch)) {
+		output = wl_container_of(batch.next, output, render_link);
+		wl_list_remove(&output->render_link);
+		wl_list_init(&output->render_link);
+		/* Failed frames are retried too, see qubes_output_frame() */
+		const bool ok =
+		   output->render_staged && qubes_output_end_frame(output);
+		if (ok || qubes_output_wants_frame(output))
+			qubes_output_schedule_tick(output);
+		output->render_staged = false;
+	}
+}
+
+/*
+ * With the render pool, a frame is not drawn as soon as wlroots asks for
+ * it, but once the event loop is idle, together with those of every other
+ * window that is due by then.  Returns false if that is not possible.
+ */
+static bool qubes_output_queue_frame(struct qubes_output *output)
+{
+	struct tinywl_server *server = output->server;
+
+	if (!wl_list_empty(&output->render_link))
+		return true;
+	if (!server->render_idle &&
+	    !(server->render_idle = wl_event_loop_add_idle(
+	         wl_display_get_event_loop(server->wl_display),
+	         qubes_output_render_batch, server)))
+		return false;
+	wl_list_insert(server->render_outputs.prev, &output->render_link);
+	return true;
+}
+
 static void qubes_output_frame(struct wl_listener *listener,
                                void *data __attribute__((unused)))
 {
 	struct qubes_output *output = wl_container_of(listener, output, frame);
 	assert(QUBES_VIEW_MAGIC == output->magic ||
 	       QUBES_XWAYLAND_MAGIC == output->magic);
-	if (qubes_output_mapped(output)) {
-		if (!qubes_wlr_scene_output_commit(output->scene_output, output->guest.width, output->guest.height, 60000))
+	/*
+	 * Nothing is rendered while the window is hidden.  Damage accumulates
+	 * in the damage ring and is flushed in a single dump when the window is
+	 * shown again.
+	 */
+	if (!qubes_output_hidden(output) &&
+	    !(output->flags & QUBES_OUTPUT_RECLAIMED)) {
+		/* Nothing changed and nobody asked for a frame: go idle until
+		 * wlroots schedules a frame again */
+		if (!qubes_output_wants_frame(output))
+			return;
+		if (output->server->render_pool && qubes_output_queue_frame(output))
 			return;
+		/* Allocations fail while the grant budget is exhausted, so a
+		 * failed frame is retried at the next tick rather than waiting
+		 * for damage that may never come */
+		if (!qubes_wlr_scene_output_commit(output, output->guest.width,
+		                                   output->guest.height,
+		                                   output->server->refresh_mhz) &&
+		    !qubes_output_wants_frame(output))
+			return;
+	} else {
+		if (output->output.needs_frame)
+			qubes_output_throttle_frame(output);
+		return;
 	}
-	output->output.frame_pending = true;
-	if (!output->server->frame_pending) {
-		// Schedule another timer callback
-		wl_event_source_timer_update(output->server->timer, 16);
-		output->server->frame_pending = true;
+	qubes_output_schedule_tick(output);
+}
+
+void qubes_output_frame_tick(void *data)
+{
+	struct tinywl_server *server = data;
+	struct timespec now;
+	struct wl_list due;
+
+	assert(clock_gettime(CLOCK_MONOTONIC, &now) == 0);
+	/* Outputs that draw again are put back on server->frame_outputs */
+	wl_list_init(&due);
+	wl_list_insert_list(&due, &server->frame_outputs);
+	wl_list_init(&server->frame_outputs);
+	while (!wl_list_empty(&due)) {
+		struct qubes_output *output =
+		   wl_container_of(due.next, output, frame_link);
+		wl_list_remove(&output->frame_link);
+		wl_list_init(&output->frame_link);
+		/* The daemon is behind.  frame_pending stays set, so nothing is
+		 * drawn and damage accumulates until qubes_output_release_dump()
+		 * puts the output back on the list. */
+		if (qubes_output_ack_pending(output)) {
+			output->swap.ack_wait = true;
+			output->swap.ack_waits++;
+			continue;
+		}
+		output->output.frame_pending = false;
+		wlr_output_send_frame(&output->output);
+		wlr_scene_node_for_each_buffer(&output->scene_output->scene->tree.node,
+		                               qubes_output_send_frame_done, &now);
+	}
+}
+
+/*
+ * Has a buffer for the given size granted and prefaulted in the background,
+ * so that it is ready by the time the client has drawn at that size.
+ */
+static void qubes_output_prefetch(struct qubes_output *output, uint32_t width,
+                                  uint32_t height)
+{
+	/* Arenas grow by whole regions, which the pool already provides */
+	if (output->server->window_arenas)
+		return;
+	uint64_t const bytes = (uint64_t)width * height * sizeof(uint32_t);
+	qubes_allocator_prefetch(
+	   output->server->allocator,
+	   QUBES_MAX((uint32_t)NUM_PAGES(bytes), output->resize_reserve_pages));
+}
+
+/* Resizes closer together than this are treated as an interactive resize */
+#define QUBES_RESIZE_DRAG_INTERVAL_MS 250
+
+static void qubes_output_end_drag(struct qubes_output *output)
+{
+	if (output->resize_reserve_pages) {
+		qubes_window_log(output, WLR_DEBUG,
+		                 "Interactive resize finished, releasing %" PRIu32
+		                 " reserved pages",
+		                 output->resize_reserve_pages);
+		qubes_allocator_end_reserve(output->server->allocator,
+		                            output->resize_reserve_pages);
+		output->resize_reserve_pages = 0;
+	}
+	output->resize_max_width = output->resize_max_height = 0;
+}
+
+/*
+ * Buffers allocated during an interactive resize are sized for the largest
+ * size it reserved for, so once it settles, the swapchain is replaced to
+ * allocate them again at the final size.
+ */
+static int qubes_output_resize_settled(void *data)
+{
+	struct qubes_output *output = data;
+	struct wlr_swapchain *swapchain = output->output.swapchain;
+	bool oversized = false;
+
+	qubes_output_end_drag(output);
+	if (!swapchain || output->render_building)
+		return 0;
+	for (size_t i = 0; i < WLR_SWAPCHAIN_CAP && !oversized; ++i) {
+		struct wlr_buffer *raw_buffer = swapchain->slots[i].buffer;
+		if (!raw_buffer || raw_buffer->impl != qubes_buffer_impl_addr)
+			continue;
+		struct qubes_buffer *buffer = wl_container_of(raw_buffer, buffer, inner);
+		oversized = !buffer->region && buffer->pages > NUM_PAGES(buffer->size);
+	}
+	if (oversized) {
+		uint32_t const pages = qubes_output_replace_swapchain(output);
+		qubes_window_log(output, WLR_DEBUG,
+		                 "Resize settled, reallocating buffers (%" PRIu32
+		                 " pages freed)",
+		                 pages);
+	}
+	return 0;
+}
+
+void qubes_output_note_resize(struct qubes_output *output, uint32_t timestamp,
+                              uint32_t width, uint32_t height)
+{
+	bool const drag =
+	   output->resize_max_width != 0 &&
+	   timestamp - output->last_resize_msec < QUBES_RESIZE_DRAG_INTERVAL_MS;
+
+	output->last_resize_msec = timestamp;
+	if (!output->resize_timer) {
+		struct wl_event_loop *loop =
+		   wl_display_get_event_loop(output->server->wl_display);
+		output->resize_timer =
+		   wl_event_loop_add_timer(loop, qubes_output_resize_settled, output);
+	}
+	if (output->resize_timer)
+		wl_event_source_timer_update(output->resize_timer,
+		                             QUBES_RESIZE_DRAG_INTERVAL_MS);
+	if (!drag) {
+		qubes_output_end_drag(output);
+		output->resize_max_width = width;
+		output->resize_max_height = height;
+		qubes_output_prefetch(output, width, height);
+		return;
 	}
+	output->resize_max_width = QUBES_MAX(output->resize_max_width, width);
+	output->resize_max_height = QUBES_MAX(output->resize_max_height, height);
+
+	/* Leave 25% headroom so that the drag can keep growing for a while */
+	uint64_t bytes = (uint64_t)output->resize_max_width *
+	                 output->resize_max_height * sizeof(uint32_t);
+	bytes = QUBES_MIN(bytes + bytes / 4, (uint64_t)MAX_WINDOW_WIDTH *
+	                                        MAX_WINDOW_HEIGHT *
+	                                        sizeof(uint32_t));
+	uint32_t const pages = (uint32_t)NUM_PAGES(bytes);
+	if (pages <= output->resize_reserve_pages)
+		return;
+	qubes_window_log(output, WLR_DEBUG,
+	                 "Interactive resize: reserving %" PRIu32 " pages", pages);
+	qubes_allocator_begin_reserve(output->server->allocator, pages);
+	if (output->resize_reserve_pages)
+		qubes_allocator_end_reserve(output->server->allocator,
+		                            output->resize_reserve_pages);
+	output->resize_reserve_pages = pages;
+	qubes_output_prefetch(output, width, height);
+}
+
+static int qubes_output_reclaim_buffers(void *data)
+{
+	struct qubes_output *output = data;
+
+	if (!qubes_output_hidden(output) ||
+	    (output->flags & QUBES_OUTPUT_RECLAIMED))
+		return 0;
+	/* The shown buffer must not be reused while the daemon has not
+	 * acknowledged it */
+	if (output->buffer && output->buffer->impl == qubes_buffer_impl_addr) {
+		struct qubes_buffer *buffer =
+		   wl_container_of(output->buffer, buffer, inner);
+		if (buffer->refcount > 1) {
+			/* Retried by qubes_output_dump_acked() rather than by polling,
+			 * so that an idle compositor does not wake up */
+			output->flags |= QUBES_OUTPUT_RECLAIM_DUE;
+			return 0;
+		}
+	}
+	output->flags &= ~QUBES_OUTPUT_RECLAIM_DUE;
+	qubes_window_log(output, WLR_DEBUG, "Releasing buffers of hidden window");
+	if (output->buffer) {
+		wl_list_remove(&output->buffer_destroy.link);
+		wlr_buffer_unlock(output->buffer);
+		output->buffer = NULL;
+	}
+	wlr_buffer_unlock(output->client_buffer);
+	output->client_buffer = NULL;
+	/* wlroots frees the swapchain of a disabled output, as for an
+	 * unmapped window.  Like those, the output gets no frame events, so
+	 * its clients get no frame done events until it is shown again. */
+	if (output->output.enabled) {
+		struct wlr_output_state state;
+		wlr_output_state_init(&state);
+		wlr_output_state_set_enabled(&state, false);
+		wlr_output_commit_state(&output->output, &state);
+		wlr_output_state_finish(&state);
+	}
+	if (output->arena)
+		qubes_arena_reset(output->arena);
+	output->flags |= QUBES_OUTPUT_RECLAIMED;
+	return 0;
+}
+
+static void qubes_output_visibility_changed(struct qubes_output *output)
+{
+	struct tinywl_server *server = output->server;
+
+	if (qubes_output_hidden(output)) {
+		if ((output->flags & QUBES_OUTPUT_RECLAIMED) ||
+		    server->hidden_reclaim_ms < 0)
+			return;
+		if (!output->reclaim_timer) {
+			struct wl_event_loop *loop =
+			   wl_display_get_event_loop(server->wl_display);
+			output->reclaim_timer = wl_event_loop_add_timer(
+			   loop, qubes_output_reclaim_buffers, output);
+			if (!output->reclaim_timer)
+				return;
+		}
+		/* 0 would disarm the timer */
+		wl_event_source_timer_update(output->reclaim_timer,
+		                             QUBES_MAX(server->hidden_reclaim_ms, 1));
+		return;
+	}
+	if (output->reclaim_timer)
+		wl_event_source_timer_update(output->reclaim_timer, 0);
+	if (output->hidden_frame_timer)
+		wl_event_source_timer_update(output->hidden_frame_timer, 0);
+	output->hidden_frame_armed = false;
+	output->flags &= ~QUBES_OUTPUT_RECLAIM_DUE;
+	if (output->flags & QUBES_OUTPUT_RECLAIMED) {
+		qubes_window_log(output, WLR_DEBUG, "Rebuilding buffers of window");
+		output->flags &= ~QUBES_OUTPUT_RECLAIMED;
+		output->flags |= QUBES_OUTPUT_DAMAGE_ALL;
+		wlr_damage_ring_add_whole(&output->scene_output->damage_ring);
+		/* Disabled by qubes_output_reclaim_buffers(), unless the window
+		 * was unmapped and qubes_output_map() already enabled it */
+		if (!output->output.enabled) {
+			struct wlr_output_state state;
+			wlr_output_state_init(&state);
+			wlr_output_state_set_enabled(&state, true);
+			wlr_output_state_set_custom_mode(&state, output->guest.width,
+			                                 output->guest.height,
+			                                 server->refresh_mhz);
+			wlr_output_commit_state(&output->output, &state);
+			wlr_output_state_finish(&state);
+		}
+	}
+	/* Flushes the damage accumulated while hidden */
+	wlr_output_schedule_frame(&output->output);
+}
+
+void qubes_output_set_minimized(struct qubes_output *output, bool minimized)
+{
+	if (minimized == !!(output->flags & QUBES_OUTPUT_MINIMIZED))
+		return;
+	if (minimized)
+		output->flags |= QUBES_OUTPUT_MINIMIZED;
+	else
+		output->flags &= ~QUBES_OUTPUT_MINIMIZED;
+	qubes_output_visibility_changed(output);
+}
+
+/*
+ * Replaces the swapchain with an empty one of the same size and format, as
+ * wlroots has no way to drop single slots.  Buffers that are displayed,
+ * rendered to or held for the daemon (acquired slots) are freed once their
+ * last lock goes, and later frames allocate from the new swapchain.  Returns
+ * the number of grant pages freed right away.
+ */
+static uint32_t qubes_output_replace_swapchain(struct qubes_output *output)
+{
+	struct wlr_swapchain *swapchain = output->output.swapchain;
+	uint32_t pages = 0;
+
+	struct wlr_swapchain *fresh =
+	   wlr_swapchain_create(swapchain->allocator, swapchain->width,
+	                        swapchain->height, &swapchain->format);
+	if (!fresh)
+		return 0;
+	for (size_t i = 0; i < WLR_SWAPCHAIN_CAP; ++i) {
+		const struct wlr_swapchain_slot *slot = &swapchain->slots[i];
+		if (slot->acquired || !slot->buffer ||
+		    slot->buffer->impl != qubes_buffer_impl_addr)
+			continue;
+		struct qubes_buffer *buffer =
+		   wl_container_of(slot->buffer, buffer, inner);
+		/* Arena slots only free up room in the arena, and dumps the daemon
+		 * has not ACKed keep their buffer until the ACK */
+		if (!buffer->region && buffer->refcount == 1)
+			pages += buffer->pages;
+	}
+	wlr_swapchain_destroy(swapchain);
+	output->output.swapchain = fresh;
+	return pages;
+}
+
+/* Replaces the swapchain if it holds more than keep buffers */
+static uint32_t qubes_output_trim_swapchain(struct qubes_output *output,
+                                            unsigned int keep)
+{
+	struct wlr_swapchain *swapchain = output->output.swapchain;
+	unsigned int allocated = 0, spare = 0;
+
+	/* Allocations can cause pressure, which must not pull the swapchain
+	 * from under wlr_swapchain_acquire() */
+	if (!swapchain || output->render_building)
+		return 0;
+	for (size_t i = 0; i < WLR_SWAPCHAIN_CAP; ++i) {
+		const struct wlr_swapchain_slot *slot = &swapchain->slots[i];
+		if (!slot->buffer)
+			continue;
+		allocated++;
+		if (!slot->acquired)
+			spare++;
+	}
+	if (allocated <= keep || spare == 0)
+		return 0;
+	uint32_t const pages = qubes_output_replace_swapchain(output);
+	if (pages)
+		qubes_window_log(output, WLR_DEBUG,
+		                 "Dropped spare buffers of %" PRIu32 " pages", pages);
+	return pages;
+}
+
+uint32_t qubes_output_drop_spare_buffers(struct qubes_output *output)
+{
+	return qubes_output_trim_swapchain(output, 0);
+}
+
+void qubes_output_dump_stats(struct qubes_output *output, FILE *out)
+{
+	struct wlr_swapchain *swapchain = output->output.swapchain;
+	uint32_t buffers = 0, pages = 0;
+	uint64_t bytes = 0;
+
+	for (size_t i = 0; swapchain && i < WLR_SWAPCHAIN_CAP; ++i) {
+		struct wlr_buffer *raw_buffer = swapchain->slots[i].buffer;
+		if (!raw_buffer || raw_buffer->impl != qubes_buffer_impl_addr)
+			continue;
+		struct qubes_buffer *buffer = wl_container_of(raw_buffer, buffer, inner);
+		buffers++;
+		pages += buffer->pages;
+		bytes += buffer->size;
+	}
+	fprintf(out,
+	        "  window %" PRIu32 " (%s, %" PRIu32 "x%" PRIu32 "): %" PRIu32
+	        " buffers, %" PRIu32 " pages, %" PRIu64 " bytes\n"
+	        "    swapchain depth %" PRIu32 " (grew %" PRIu64 ", shrank %" PRIu64
+	        " times), %" PRIu64 " dumps, %" PRIu64 " acks, ACK latency %" PRIu32
+	        " us, frame interval %" PRIu32 " us, first frame %" PRIu32 " us\n"
+	        "    dump queue: %" PRIu32 " unacknowledged (peak %" PRIu32
+	        "), %" PRIu64 " frames held back waiting for ACKs\n"
+	        "    fast paths: %" PRIu64 " zero-copy frames, %" PRIu64
+	        " direct-copy frames (%" PRIu64 " bytes copied), %" PRIu64
+	        " tile-parallel frames, %" PRIu64
+	        " resizes keeping contents (%" PRIu64 " bytes copied)\n"
+	        "    damage: %" PRIu64 " rectangles (%" PRIu64 " pixels) sent as %" PRIu64
+	        " messages (%" PRIu64 " pixels), pixel diff examined %" PRIu64
+	        " bytes and saved %" PRIu64 " bytes\n",
+	        output->window_id, qubes_output_mapped(output) ? "mapped" : "unmapped",
+	        output->guest.width, output->guest.height, buffers, pages, bytes,
+	        output->swap.depth, output->swap.grows, output->swap.shrinks,
+	        output->swap.dumps, output->swap.acks, output->swap.ack_latency_us,
+	        output->swap.interval_us, output->first_frame_us,
+	        output->swap.outstanding, output->swap.outstanding_peak,
+	        output->swap.ack_waits, output->zero_copy_frames,
+	        output->direct_copy_frames, output->direct_copy_bytes,
+	        output->parallel_frames, output->resizes_kept,
+	        output->resize_kept_bytes,
+	        output->damage_stats.rects, output->damage_stats.pixels_in,
+	        output->damage_stats.messages, output->damage_stats.pixels_out,
+	        output->damage_stats.diff_examined, output->damage_stats.diff_saved);
 }
 
 static void qubes_output_clear_surface(struct qubes_output *const output)
@@ -387,7 +1804,8 @@ bool qubes_output_init(struct qubes_output *const output,
 		struct wlr_output_state state;
 		wlr_output_state_init(&state);
 		wlr_output_state_set_enabled(&state, true);
-		wlr_output_state_set_custom_mode(&state, 1280, 720, 60000);
+		wlr_output_state_set_custom_mode(&state, 1280, 720,
+		                                 server->refresh_mhz);
 		wlr_output_init(&output->output, backend, &qubes_wlr_output_impl,
 		                wl_display_get_event_loop(server->wl_display), &state);
 		wlr_output_commit_state(&output->output, &state);
@@ -406,12 +1824,15 @@ bool qubes_output_init(struct qubes_output *const output,
 	output->buffer_destroy.notify = qubes_unlink_buffer_listener;
 	output->formats = &global_formats;
 	output->frame.notify = qubes_output_frame;
+	output->swap.depth = 2;
 	output->magic = magic;
 	output->flags = is_override_redirect ? QUBES_OUTPUT_OVERRIDE_REDIRECT : 0,
 	output->server = server;
 	wl_signal_add(&output->output.events.frame, &output->frame);
 
 	wl_list_insert(&server->views, &output->link);
+	wl_list_init(&output->frame_link);
+	wl_list_init(&output->render_link);
 	assert(output->output.allocator == NULL);
 	assert(server->allocator != NULL);
 	/* Add wlr_output */
@@ -474,6 +1895,8 @@ void qubes_output_deinit(struct qubes_output *output)
 	if (output->scene_subsurface_tree)
 		wlr_scene_node_destroy(&output->scene_subsurface_tree->node);
 	wl_list_remove(&output->link);
+	wl_list_remove(&output->frame_link);
+	wl_list_remove(&output->render_link);
 	struct msg_hdr header = {
 		.type = MSG_DESTROY,
 		.window = output->window_id,
@@ -487,7 +1910,17 @@ void qubes_output_deinit(struct qubes_output *output)
 	if (output->scene_output) {
 		wlr_scene_output_destroy(output->scene_output);
 	}
+	if (output->resize_timer)
+		wl_event_source_remove(output->resize_timer);
+	if (output->reclaim_timer)
+		wl_event_source_remove(output->reclaim_timer);
+	if (output->hidden_frame_timer)
+		wl_event_source_remove(output->hidden_frame_timer);
+	if (output->present_idle)
+		wl_event_source_remove(output->present_idle);
+	qubes_output_end_drag(output);
 	wlr_output_destroy(&output->output);
+	qubes_arena_destroy(output->arena);
 	free(output->name);
 	memset(output, 0, sizeof(*output));
 }
@@ -540,6 +1973,7 @@ void qubes_output_unmap(struct qubes_output *output)
 		        MSG_UNMAP, output->window_id);
 		qubes_rust_send_message(output->server->backend->rust_backend, &header);
 	}
+	qubes_output_visibility_changed(output);
 }
 
 void qubes_output_map(struct qubes_output *output,
@@ -552,9 +1986,12 @@ void qubes_output_map(struct qubes_output *output,
 		wlr_scene_node_set_enabled(&output->scene_subsurface_tree->node, true);
 		wlr_output_state_init(&state);
 		wlr_output_state_set_enabled(&state, true);
-		wlr_output_state_set_custom_mode(&state, output->guest.width, output->guest.height, 60);
+		wlr_output_state_set_custom_mode(&state, output->guest.width,
+		                                 output->guest.height,
+		                                 output->server->refresh_mhz);
 		wlr_output_commit_state(&output->output, &state);
 		wlr_output_state_finish(&state);
+		qubes_output_visibility_changed(output);
 	}
 
 	// clang-format off
@@ -589,6 +2026,8 @@ bool qubes_output_configure(struct qubes_output *output, struct wlr_box box)
 		   !((box.x == output->guest.x) && (box.y == output->guest.y) &&
 		     ((unsigned int)box.width == output->guest.width) &&
 		     ((unsigned int)box.height == output->guest.height));
+		bool const resized = (unsigned int)box.width != output->guest.width ||
+		                     (unsigned int)box.height != output->guest.height;
 		output->guest.x = box.x;
 		output->guest.y = box.y;
 		output->guest.width = (unsigned)box.width;
@@ -597,6 +2036,20 @@ bool qubes_output_configure(struct qubes_output *output, struct wlr_box box)
 			return false;
 		if (send_configure)
 			qubes_send_configure(output);
+		/*
+		 * The daemon discards the window contents when it is resized.
+		 * The mode change of the next commit usually implies full damage,
+		 * but not if the size changes back before that commit.  Keeping
+		 * the old contents in the new buffer (see
+		 * qubes_output_keep_contents()) saves rendering, but the whole
+		 * buffer must still be sent.  Moves keep the contents, so they
+		 * do not need any damage.
+		 */
+		if (resized) {
+			output->flags |= QUBES_OUTPUT_DAMAGE_ALL;
+			qubes_output_prefetch(output, output->guest.width,
+			                      output->guest.height);
+		}
 		wlr_output_send_frame(&output->output);
 		return true;
 	}
@@ -3,6 +3,7 @@
 	_Pragma("GCC error \"double-include guard referenced\"")
 
 #include "common.h"
+#include <stdio.h>
 #include <wayland-server-core.h>
 #include <wlr/interfaces/wlr_output.h>
 #include <wlr/util/box.h>
@@ -11,9 +12,14 @@
 
 struct qubes_output {
 	struct wl_list link;
+	struct wl_list frame_link; /* tinywl_server::frame_outputs, or empty */
+	struct wl_list render_link; /* tinywl_server::render_outputs, or empty */
 	struct wlr_output output;
 	struct wl_listener buffer_destroy;
 	struct wlr_buffer *buffer;   /* owned by the compositor */
+	/* Client buffer behind an imported buffer, locked while it is shown.
+	 * Only used before protocol 1.7; later, each qubes_link holds it. */
+	struct wlr_buffer *client_buffer;
 	struct wlr_surface *surface; /* ditto */
 	struct wl_listener frame;
 	struct msg_keymap_notify keymap;
@@ -28,6 +34,52 @@ struct qubes_output {
 		int32_t x, y;
 		uint32_t width, height;
 	} host, guest;
+	/* Interactive resize tracking, see qubes_output_note_resize() */
+	struct wl_event_source *resize_timer;
+	uint32_t last_resize_msec;
+	uint32_t resize_max_width, resize_max_height;
+	uint32_t resize_reserve_pages;
+	/* Releases the buffers of hidden windows, armed by
+	 * qubes_output_visibility_changed(), see qubes_output_set_minimized() */
+	struct wl_event_source *reclaim_timer;
+	/* Paces frame done events while hidden, see qubes_output_throttle_frame() */
+	struct wl_event_source *hidden_frame_timer;
+	bool hidden_frame_armed;
+	/* Presentation feedback without DUMP_ACK, see qubes_output_defer_present() */
+	struct wl_event_source *present_idle;
+	uint32_t present_seq;
+	struct qubes_arena *arena; /* NULL unless window arenas are enabled */
+	/* Adaptive swapchain depth, see qubes_output_dump_buffer() */
+	struct {
+		uint64_t last_dump_ns;
+		uint32_t interval_us, ack_latency_us; /* moving averages */
+		uint32_t depth;                       /* 2 or 3 */
+		bool dump_held; /* a dumped buffer is locked until acknowledged */
+		/* Frame events are held back until the daemon catches up, see
+		 * qubes_output_frame_tick() */
+		bool ack_wait;
+		uint32_t outstanding, outstanding_peak; /* dumps not yet ACKed */
+		uint64_t dumps, acks, grows, shrinks, ack_waits;
+	} swap;
+	uint32_t first_frame_us; /* time taken to render and dump the first frame */
+	uint64_t zero_copy_frames; /* see qubes_output_build_zero_copy() */
+	/* see qubes_output_build_direct_copy() */
+	uint64_t direct_copy_frames, direct_copy_bytes;
+	uint64_t parallel_frames; /* see qubes_output_prepare_parallel() */
+	/* see qubes_output_keep_contents() */
+	uint64_t resizes_kept, resize_kept_bytes;
+	/* Frame being drawn, see qubes_output_begin_frame() */
+	struct wlr_output_state render_state;
+	struct qubes_render_frame *render_frame; /* tiles left to composite */
+	uint64_t render_start;
+	bool render_first, render_staged;
+	bool render_building; /* the swapchain may be allocating a buffer */
+	/* Damage rectangles before and after qubes_damage_coalesce() */
+	struct {
+		uint64_t rects, pixels_in;
+		uint64_t messages, pixels_out;
+		uint64_t diff_examined, diff_saved; /* bytes */
+	} damage_stats;
 	uint32_t window_id;
 	uint32_t magic;
 	uint32_t flags;
@@ -36,6 +88,13 @@ struct qubes_output {
 struct qubes_link {
 	struct qubes_link *next;
 	struct qubes_buffer *buffer;
+	/* Client buffer behind an imported buffer, locked until the ACK */
+	struct wlr_buffer *client_buffer;
+	uint64_t sent_ns;
+	uint32_t window_id;
+	uint32_t commit_seq; /* output commit whose presentation this is */
+	bool held; /* buffer locked so that the swapchain cannot reuse it */
+	bool present; /* dumped by a commit, not by qubes_output_dump_buffer() */
 };
 
 struct tinywl_server;
@@ -54,6 +113,9 @@ enum {
 	QUBES_OUTPUT_WIDTH_CHANGED  = 1 << 10,
 	QUBES_OUTPUT_HEIGHT_CHANGED = 1 << 11,
 	QUBES_OUTPUT_NEED_CONFIGURE_ACK = 1 << 12,
+	QUBES_OUTPUT_MINIMIZED      = 1 << 13,
+	QUBES_OUTPUT_RECLAIMED      = 1 << 14,
+	QUBES_OUTPUT_RECLAIM_DUE    = 1 << 15, /* waiting for a DUMP_ACK */
 };
 #define QUBES_CHANGED_MASK (QUBES_OUTPUT_LEFT_CHANGED|QUBES_OUTPUT_RIGHT_CHANGED|QUBES_OUTPUT_TOP_CHANGED|QUBES_OUTPUT_BOTTOM_CHANGED|QUBES_OUTPUT_WIDTH_CHANGED|QUBES_OUTPUT_HEIGHT_CHANGED)
 static inline bool qubes_output_created(struct qubes_output *output)
@@ -86,6 +148,13 @@ qubes_output_need_configure(struct qubes_output *output)
 	return output->flags & QUBES_OUTPUT_NEED_CONFIGURE;
 }
 
+/* Unmapped and minimized windows are hidden */
+static inline bool qubes_output_hidden(struct qubes_output *output)
+{
+	return !qubes_output_mapped(output) ||
+	       (output->flags & QUBES_OUTPUT_MINIMIZED);
+}
+
 static inline bool
 qubes_output_resized(struct qubes_output *output)
 {
@@ -119,6 +188,49 @@ void qubes_set_view_title(struct qubes_output *output, const char *const title);
 void qubes_output_set_class(struct qubes_output *output, const char *class);
 bool qubes_output_move(struct qubes_output *output, int32_t x, int32_t y);
 bool qubes_output_commit_size(struct qubes_output *output, struct wlr_box box);
+/*
+ * Called when the GUI daemon changes the size of a window.  If resizes come
+ * in quick succession, the user is probably dragging a window edge, so buffers
+ * are over-allocated to the largest size seen (plus some headroom) until the
+ * resizing stops.  This lets each step reuse the previous step's buffers.
+ */
+void qubes_output_note_resize(struct qubes_output *output, uint32_t timestamp,
+                              uint32_t width, uint32_t height);
+/*
+ * Drops the buffers in the output's swapchain that are neither displayed nor
+ * being rendered to.  Returns the number of grant pages they used, which are
+ * released once the GUI daemon no longer uses them.
+ */
+uint32_t qubes_output_drop_spare_buffers(struct qubes_output *output);
+/*
+ * Called when a window is minimized or restored.  Once a window has been
+ * hidden for the configured time, its buffers are released; they are rebuilt,
+ * and the whole window redrawn, when it is shown again.
+ */
+void qubes_output_set_minimized(struct qubes_output *output, bool minimized);
+/*
+ * Called when the GUI daemon acknowledges the window dump at the head of the
+ * queue, after it has been unlinked.  Frees the link.  This is when the
+ * commit that made the dump counts as presented.
+ */
+void qubes_output_dump_acked(struct tinywl_server *server,
+                             struct qubes_link *link);
+/*
+ * Empties the queue of window dumps without treating them as acknowledged.
+ * Called when reconnecting, since a new GUI daemon never ACKs the dumps that
+ * were sent to its predecessor.
+ */
+void qubes_output_drop_dumps(struct tinywl_server *server);
+/**
+ * Frame clock callback.  Sends frame events and frame done events to the
+ * outputs that drew since the previous tick (or whose clients asked for a
+ * frame) and to no others, so its cost scales with the number of active
+ * windows.  The timer is only armed while some output is waiting for a tick.
+ * Outputs with too many unacknowledged dumps are skipped until an ACK comes.
+ */
+void qubes_output_frame_tick(void *data);
+/* Writes the number of buffers, pages, and bytes held by the output */
+void qubes_output_dump_stats(struct qubes_output *output, FILE *out);
 
 #define qubes_window_log(output, loglevel, fmt, ...) \
 	do wlr_log((loglevel), "Window %" PRIu32 ": " fmt, (output)->window_id,## __VA_ARGS__); while (0)
@@ -0,0 +1,227 @@
+// Narrowing of reported damage to the pixels that actually changed, and
+// copying of damaged pixels between buffers
+
+#include "common.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define QUBES_PIXEL_DIFF_X86 1
+#endif
+
+#include "qubes_pixel_diff.h"
+
+typedef bool (*qubes_rows_differ_fn)(const uint8_t *a, const uint8_t *b,
+                                     size_t len);
+
+static bool qubes_rows_differ_scalar(const uint8_t *a, const uint8_t *b,
+                                     size_t len)
+{
+	return memcmp(a, b, len) != 0;
+}
+
+#ifdef QUBES_PIXEL_DIFF_X86
+__attribute__((target("sse2"))) static bool
+qubes_rows_differ_sse2(const uint8_t *a, const uint8_t *b, size_t len)
+{
+	size_t i = 0;
+	for (; i + 16 <= len; i += 16) {
+		const __m128i x = _mm_loadu_si128((const __m128i *)(a + i));
+		const __m128i y = _mm_loadu_si128((const __m128i *)(b + i));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) != 0xFFFF)
+			return true;
+	}
+	return memcmp(a + i, b + i, len - i) != 0;
+}
+
+__attribute__((target("avx2"))) static bool
+qubes_rows_differ_avx2(const uint8_t *a, const uint8_t *b, size_t len)
+{
+	size_t i = 0;
+	for (; i + 32 <= len; i += 32) {
+		const __m256i x = _mm256_loadu_si256((const __m256i *)(a + i));
+		const __m256i y = _mm256_loadu_si256((const __m256i *)(b + i));
+		const __m256i delta = _mm256_xor_si256(x, y);
+		if (!_mm256_testz_si256(delta, delta))
+			return true;
+	}
+	return memcmp(a + i, b + i, len - i) != 0;
+}
+#endif
+
+static qubes_rows_differ_fn qubes_rows_differ_impl(void)
+{
+	static qubes_rows_differ_fn impl;
+
+	if (impl)
+		return impl;
+	impl = qubes_rows_differ_scalar;
+#ifdef QUBES_PIXEL_DIFF_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		impl = qubes_rows_differ_avx2;
+	else if (__builtin_cpu_supports("sse2"))
+		impl = qubes_rows_differ_sse2;
+#endif
+	return impl;
+}
+
+typedef void (*qubes_row_copy_fn)(uint8_t *dst, const uint8_t *src,
+                                  size_t len);
+
+/* Alpha channel of DRM_FORMAT_ARGB8888 and padding of DRM_FORMAT_XRGB8888 */
+#define QUBES_PIXEL_OPAQUE UINT32_C(0xFF000000)
+
+static void qubes_row_copy_scalar(uint8_t *dst, const uint8_t *src, size_t len)
+{
+	for (size_t i = 0; i < len; i += sizeof(uint32_t)) {
+		uint32_t pixel;
+		memcpy(&pixel, src + i, sizeof pixel);
+		pixel |= QUBES_PIXEL_OPAQUE;
+		memcpy(dst + i, &pixel, sizeof pixel);
+	}
+}
+
+#ifdef QUBES_PIXEL_DIFF_X86
+__attribute__((target("sse2"))) static void
+qubes_row_copy_sse2(uint8_t *dst, const uint8_t *src, size_t len)
+{
+	const __m128i opaque = _mm_set1_epi32((int)QUBES_PIXEL_OPAQUE);
+	size_t i = 0;
+	for (; i + 16 <= len; i += 16) {
+		const __m128i x = _mm_loadu_si128((const __m128i *)(src + i));
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_or_si128(x, opaque));
+	}
+	qubes_row_copy_scalar(dst + i, src + i, len - i);
+}
+
+__attribute__((target("avx2"))) static void
+qubes_row_copy_avx2(uint8_t *dst, const uint8_t *src, size_t len)
+{
+	const __m256i opaque = _mm256_set1_epi32((int)QUBES_PIXEL_OPAQUE);
+	size_t i = 0;
+	for (; i + 32 <= len; i += 32) {
+		const __m256i x = _mm256_loadu_si256((const __m256i *)(src + i));
+		_mm256_storeu_si256((__m256i *)(dst + i), _mm256_or_si256(x, opaque));
+	}
+	qubes_row_copy_scalar(dst + i, src + i, len - i);
+}
+#endif
+
+static qubes_row_copy_fn qubes_row_copy_impl(void)
+{
+	static qubes_row_copy_fn impl;
+
+	if (impl)
+		return impl;
+	impl = qubes_row_copy_scalar;
+#ifdef QUBES_PIXEL_DIFF_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		impl = qubes_row_copy_avx2;
+	else if (__builtin_cpu_supports("sse2"))
+		impl = qubes_row_copy_sse2;
+#endif
+	return impl;
+}
+
+/* Whether any pixel in the given part of the two images differs */
+static bool qubes_box_differs(qubes_rows_differ_fn differ, const uint8_t *old,
+                              const uint8_t *new, size_t stride,
+                              const pixman_box32_t *box)
+{
+	const size_t offset = (size_t)box->x1 * sizeof(uint32_t);
+	const size_t len = (size_t)(box->x2 - box->x1) * sizeof(uint32_t);
+	for (int32_t y = box->y1; y < box->y2; ++y) {
+		const size_t row = (size_t)y * stride + offset;
+		if (differ(old + row, new + row, len))
+			return true;
+	}
+	return false;
+}
+
+uint64_t qubes_pixel_diff(const void *old, const void *new, uint32_t width,
+                          uint32_t height, const pixman_region32_t *damage,
+                          pixman_region32_t *changed)
+{
+	const qubes_rows_differ_fn differ = qubes_rows_differ_impl();
+	const size_t stride = (size_t)width * sizeof(uint32_t);
+	const int32_t tile = QUBES_PIXEL_DIFF_TILE;
+	uint64_t compared = 0;
+	pixman_region32_t clipped;
+	int n_rects = 0;
+
+	pixman_region32_init_rect(&clipped, 0, 0, width, height);
+	pixman_region32_intersect(&clipped, &clipped,
+	                          (pixman_region32_t *)damage);
+	pixman_region32_clear(changed);
+	const pixman_box32_t *rects = pixman_region32_rectangles(&clipped, &n_rects);
+	for (int i = 0; i < n_rects; ++i) {
+		const pixman_box32_t *rect = rects + i;
+		/* Tiles are aligned to the image, not to the rectangle */
+		for (int32_t ty = rect->y1 - rect->y1 % tile; ty < rect->y2; ty += tile) {
+			const int32_t y1 = QUBES_MAX(ty, rect->y1);
+			const int32_t y2 = QUBES_MIN(ty + tile, rect->y2);
+			/* Runs of changed tiles in this row are added as one box */
+			int32_t run_start = -1, run_end = -1;
+			for (int32_t tx = rect->x1 - rect->x1 % tile; tx < rect->x2;
+			     tx += tile) {
+				const pixman_box32_t box = {
+					.x1 = QUBES_MAX(tx, rect->x1),
+					.y1 = y1,
+					.x2 = QUBES_MIN(tx + tile, rect->x2),
+					.y2 = y2,
+				};
+				if (!qubes_box_differs(differ, old, new, stride, &box))
+					continue;
+				if (run_end != box.x1) {
+					if (run_start >= 0)
+						pixman_region32_union_rect(changed, changed, run_start, y1,
+						                           (unsigned)(run_end - run_start),
+						                           (unsigned)(y2 - y1));
+					run_start = box.x1;
+				}
+				run_end = box.x2;
+			}
+			if (run_start >= 0)
+				pixman_region32_union_rect(changed, changed, run_start, y1,
+				                           (unsigned)(run_end - run_start),
+				                           (unsigned)(y2 - y1));
+			compared += (uint64_t)(rect->x2 - rect->x1) * (uint64_t)(y2 - y1) *
+			            sizeof(uint32_t);
+		}
+	}
+	pixman_region32_fini(&clipped);
+	return compared;
+}
+
+uint64_t qubes_pixel_copy(void *dst, size_t dst_stride, const void *src,
+                          size_t src_stride, uint32_t width, uint32_t height,
+                          const pixman_region32_t *region)
+{
+	const qubes_row_copy_fn copy = qubes_row_copy_impl();
+	uint8_t *const out = dst;
+	const uint8_t *const in = src;
+	uint64_t copied = 0;
+	pixman_region32_t clipped;
+	int n_rects = 0;
+
+	pixman_region32_init_rect(&clipped, 0, 0, width, height);
+	pixman_region32_intersect(&clipped, &clipped,
+	                          (pixman_region32_t *)region);
+	const pixman_box32_t *rects = pixman_region32_rectangles(&clipped, &n_rects);
+	for (int i = 0; i < n_rects; ++i) {
+		const pixman_box32_t *rect = rects + i;
+		const size_t offset = (size_t)rect->x1 * sizeof(uint32_t);
+		const size_t len = (size_t)(rect->x2 - rect->x1) * sizeof(uint32_t);
+		for (int32_t y = rect->y1; y < rect->y2; ++y)
+			copy(out + (size_t)y * dst_stride + offset,
+			     in + (size_t)y * src_stride + offset, len);
+		copied += (uint64_t)len * (uint64_t)(rect->y2 - rect->y1);
+	}
+	pixman_region32_fini(&clipped);
+	return copied;
+}
+
+// vim: set noet ts=3 sts=3 sw=3 ft=c fenc=UTF-8:
@@ -0,0 +1,31 @@
+#ifndef QUBES_WAYLAND_COMPOSITOR_QUBES_PIXEL_DIFF_H
+#define QUBES_WAYLAND_COMPOSITOR_QUBES_PIXEL_DIFF_H                            \
+	_Pragma("GCC error \"double-include guard referenced\"")
+#include "common.h"
+
+#include <pixman.h>
+
+/* Damage is narrowed down to tiles of this many pixels square */
+#define QUBES_PIXEL_DIFF_TILE 32
+
+/**
+ * Stores in changed the tiles of damage (clipped to damage) in which the
+ * width x height images old and new, with 32 bits per pixel and packed rows,
+ * actually differ.  Returns the size in bytes of the damage that was examined.
+ */
+uint64_t qubes_pixel_diff(const void *old, const void *new, uint32_t width,
+                          uint32_t height, const pixman_region32_t *damage,
+                          pixman_region32_t *changed);
+
+/**
+ * Copies the part of region that lies within the width x height images from
+ * src to dst, both with 32 bits per pixel and the given row strides in bytes.
+ * The copied pixels are made opaque, as they would be after being composited
+ * over the black scene background.  Returns the number of bytes copied.
+ */
+uint64_t qubes_pixel_copy(void *dst, size_t dst_stride, const void *src,
+                          size_t src_stride, uint32_t width, uint32_t height,
+                          const pixman_region32_t *region);
+
+#endif
+// vim: set noet ts=3 sts=3 sw=3 ft=c fenc=UTF-8:
@@ -0,0 +1,165 @@
+// Worker threads for tile-parallel compositing
+
+#include "common.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+
+#include "qubes_render_pool.h"
+
+struct qubes_render_pool {
+	pthread_mutex_t lock;
+	/* Signalled when a batch is posted or the pool is stopping */
+	pthread_cond_t work;
+	/* Signalled when the last job of a batch has returned */
+	pthread_cond_t done;
+	/* The current batch, only valid while next < count or running > 0 */
+	qubes_render_job_fn fn;
+	void *data;
+	unsigned int next, count, running;
+	/* Bumped for each batch, so that workers do not mistake an old one */
+	uint64_t generation;
+	bool stop;
+	unsigned int threads;
+	pthread_t workers[];
+};
+
+/*
+ * Takes jobs from the current batch until there are none left.  Called with
+ * the lock held, and returns with it held.
+ */
+static void qubes_render_pool_drain(struct qubes_render_pool *pool)
+{
+	while (pool->next < pool->count) {
+		const unsigned int index = pool->next++;
+		pool->running++;
+		assert(pthread_mutex_unlock(&pool->lock) == 0);
+		pool->fn(pool->data, index);
+		assert(pthread_mutex_lock(&pool->lock) == 0);
+		if (--pool->running == 0 && pool->next >= pool->count)
+			assert(pthread_cond_signal(&pool->done) == 0);
+	}
+}
+
+static void *qubes_render_pool_worker(void *data)
+{
+	struct qubes_render_pool *pool = data;
+	uint64_t seen = 0;
+
+	assert(pthread_mutex_lock(&pool->lock) == 0);
+	for (;;) {
+		while (!pool->stop && pool->generation == seen)
+			assert(pthread_cond_wait(&pool->work, &pool->lock) == 0);
+		if (pool->stop)
+			break;
+		seen = pool->generation;
+		qubes_render_pool_drain(pool);
+	}
+	assert(pthread_mutex_unlock(&pool->lock) == 0);
+	return NULL;
+}
+
+static void qubes_render_pool_stop(struct qubes_render_pool *pool,
+                                   unsigned int started)
+{
+	assert(pthread_mutex_lock(&pool->lock) == 0);
+	pool->stop = true;
+	assert(pthread_cond_broadcast(&pool->work) == 0);
+	assert(pthread_mutex_unlock(&pool->lock) == 0);
+	for (unsigned int i = 0; i < started; ++i)
+		assert(pthread_join(pool->workers[i], NULL) == 0);
+	assert(pthread_cond_destroy(&pool->done) == 0);
+	assert(pthread_cond_destroy(&pool->work) == 0);
+	assert(pthread_mutex_destroy(&pool->lock) == 0);
+}
+
+struct qubes_render_pool *qubes_render_pool_create(unsigned int threads)
+{
+	struct qubes_render_pool *pool;
+	sigset_t all_signals, old_mask;
+	unsigned int started = 0;
+	int err = 0;
+
+	assert(threads > 0);
+	if (!(pool = calloc(1, sizeof(*pool) + threads * sizeof(pthread_t))))
+		return NULL;
+	if ((err = pthread_mutex_init(&pool->lock, NULL)))
+		goto fail_alloc;
+	if ((err = pthread_cond_init(&pool->work, NULL)))
+		goto fail_mutex;
+	if ((err = pthread_cond_init(&pool->done, NULL)))
+		goto fail_work;
+
+	/*
+	 * Signals are received via signalfd on the main thread.  Workers are
+	 * never given client shm pools that can be truncated (see
+	 * qubes_buffer_may_shrink()), so they cannot fault on one either.
+	 */
+	assert(sigfillset(&all_signals) == 0);
+	assert(pthread_sigmask(SIG_SETMASK, &all_signals, &old_mask) == 0);
+	for (; started < threads; ++started) {
+		if ((err = pthread_create(&pool->workers[started], NULL,
+		                          qubes_render_pool_worker, pool)))
+			break;
+	}
+	assert(pthread_sigmask(SIG_SETMASK, &old_mask, NULL) == 0);
+	if (err) {
+		qubes_render_pool_stop(pool, started);
+		free(pool);
+		errno = err;
+		return NULL;
+	}
+	pool->threads = threads;
+	return pool;
+fail_work:
+	assert(pthread_cond_destroy(&pool->work) == 0);
+fail_mutex:
+	assert(pthread_mutex_destroy(&pool->lock) == 0);
+fail_alloc:
+	free(pool);
+	errno = err;
+	return NULL;
+}
+
+void qubes_render_pool_destroy(struct qubes_render_pool *pool)
+{
+	if (!pool)
+		return;
+	qubes_render_pool_stop(pool, pool->threads);
+	free(pool);
+}
+
+unsigned int qubes_render_pool_thread_count(struct qubes_render_pool *pool)
+{
+	return pool ? pool->threads : 0;
+}
+
+void qubes_render_pool_run(struct qubes_render_pool *pool,
+                           qubes_render_job_fn fn, void *data,
+                           unsigned int count)
+{
+	/* Not worth waking anyone up for */
+	if (!pool || count <= 1) {
+		for (unsigned int i = 0; i < count; ++i)
+			fn(data, i);
+		return;
+	}
+	assert(pthread_mutex_lock(&pool->lock) == 0);
+	assert(pool->next >= pool->count && pool->running == 0);
+	pool->fn = fn;
+	pool->data = data;
+	pool->next = 0;
+	pool->count = count;
+	pool->generation++;
+	assert(pthread_cond_broadcast(&pool->work) == 0);
+	/* The main thread would only be waiting otherwise */
+	qubes_render_pool_drain(pool);
+	while (pool->running > 0)
+		assert(pthread_cond_wait(&pool->done, &pool->lock) == 0);
+	assert(pthread_mutex_unlock(&pool->lock) == 0);
+}
+
+// vim: set noet ts=3 sts=3 sw=3 ft=c fenc=UTF-8:
@@ -0,0 +1,39 @@
+#ifndef QUBES_WAYLAND_COMPOSITOR_QUBES_RENDER_POOL_H
+#define QUBES_WAYLAND_COMPOSITOR_QUBES_RENDER_POOL_H                           \
+	_Pragma("GCC error \"double-include guard referenced\"")
+#include "common.h"
+
+/*
+ * A fixed pool of worker threads for splitting the compositing of one frame
+ * into tiles.  Workers only ever touch pixels, and never those of a client
+ * shm pool that can be truncated: everything else, including wlroots and
+ * Wayland objects, stays on the main thread.
+ */
+struct qubes_render_pool;
+
+typedef void (*qubes_render_job_fn)(void *data, unsigned int index);
+
+/**
+ * Starts threads workers, with all signals blocked.  Returns NULL and sets
+ * errno on failure.
+ */
+struct qubes_render_pool *qubes_render_pool_create(unsigned int threads);
+/* Stops and joins the workers */
+void qubes_render_pool_destroy(struct qubes_render_pool *pool);
+/**
+ * Returns the number of worker threads, for check_thread_count().  A NULL
+ * pool has none.
+ */
+unsigned int qubes_render_pool_thread_count(struct qubes_render_pool *pool);
+/**
+ * Calls fn(data, i) for every i below count, spread over the workers and the
+ * calling thread, and returns once all calls have returned.  Must only be
+ * called from the main thread.  A NULL pool makes all calls on the calling
+ * thread.
+ */
+void qubes_render_pool_run(struct qubes_render_pool *pool,
+                           qubes_render_job_fn fn, void *data,
+                           unsigned int count);
+
+#endif
+// vim: set noet ts=3 sts=3 sw=3 ft=c fenc=UTF-8:
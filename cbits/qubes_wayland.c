@@ -289,7 +289,8 @@ static void qubes_toplevel_ack_configure(struct wl_listener *listener,
 		output->flags &= ~QUBES_OUTPUT_NEED_CONFIGURE_ACK;
 		wlr_output_state_init(&state);
 		wlr_output_state_set_custom_mode(&state, output->host.width,
-		                                 output->host.height, 60000);
+		                                 output->host.height,
+		                                 output->server->refresh_mhz);
 		wlr_output_commit_state(&output->output, &state);
 		wlr_output_state_finish(&state);
 	}
@@ -421,7 +422,8 @@ static void qubes_new_xdg_surface(struct tinywl_server *server, struct wlr_xdg_s
 		wlr_output_state_init(&state);
 		wlr_output_state_set_enabled(&state, true);
 		wlr_output_state_set_custom_mode(&state, output->host.width,
-		                                 output->host.height, 60000);
+		                                 output->host.height,
+		                                 output->server->refresh_mhz);
 		wlr_output_commit_state(&output->output, &state);
 		wlr_output_state_finish(&state);
 	}
@@ -145,6 +145,9 @@ void qubes_handle_configure(struct qubes_output *output, uint32_t timestamp,
 	output->host.x = x;
 	output->host.y = y;
 
+	if (width != output->guest.width || height != output->guest.height)
+		qubes_output_note_resize(output, timestamp, width, height);
+
 	// Step 2: Check for Xwayland window.
 	if (QUBES_XWAYLAND_MAGIC == output->magic) {
 		// Configure window and then return.
@@ -256,7 +259,8 @@ void qubes_handle_configure(struct qubes_output *output, uint32_t timestamp,
 	struct wlr_output_state state;
 	wlr_output_state_init(&state);
 	wlr_output_state_set_enabled(&state, true);
-	wlr_output_state_set_custom_mode(&state, width, height, 60000);
+	wlr_output_state_set_custom_mode(&state, width, height,
+	                                 output->server->refresh_mhz);
 	wlr_output_commit_state(&output->output, &state);
 	wlr_output_state_finish(&state);
 }
@@ -34,8 +34,20 @@ pub struct QubesData {
     wid: u32,
     pub map: BTreeMap<NonZeroU32, *mut c_void>,
     start: std::time::Instant,
+    batch: Vec<u8>, // See NOTE: Batching messages
+    batching: bool,
 }
 
+// NOTE: Batching messages
+//
+// Committing a frame sends a MSG_WINDOW_DUMP (when the buffer changes) and a
+// MSG_SHMIMAGE for every damaged rectangle.  Passing each of them to the vchan
+// separately costs a ring write and an event channel notification apiece.
+// Between qubes_rust_begin_batch() and qubes_rust_end_batch(), messages are
+// appended to a buffer instead, which is then written in one go.  The GUI
+// protocol is a byte stream, so the daemon cannot tell the difference.  The
+// buffer is kept between frames so that its allocation is reused.
+
 impl QubesData {
     fn id(&mut self, userdata: *mut c_void) -> NonZeroU32 {
         let id = self.wid;
@@ -49,6 +61,24 @@ impl QubesData {
         id
     }
 
+    fn send_raw_bytes(&mut self, slice: &[u8]) {
+        if self.batching {
+            self.batch.extend_from_slice(slice)
+        } else {
+            self.agent.send_raw_bytes(slice)
+        }
+    }
+
+    fn flush_batch(&mut self) {
+        self.batching = false;
+        if !self.batch.is_empty() {
+            if self.enabled {
+                self.agent.send_raw_bytes(&self.batch)
+            }
+            self.batch.clear()
+        }
+    }
+
     fn destroy_id(&mut self, WindowID { window }: WindowID) {
         if let Some(id) = window {
             let v = self
@@ -272,7 +302,7 @@ pub unsafe extern "C" fn qubes_rust_send_message(
         if header.ty == qubes_gui::MSG_DESTROY {
             backend.destroy_id(header.window);
         }
-        backend.agent.send_raw_bytes(slice)
+        backend.send_raw_bytes(slice)
     })) {
         Ok(_) => {}
         Err(_) => {
@@ -284,6 +314,28 @@ pub unsafe extern "C" fn qubes_rust_send_message(
     }
 }
 
+/// Starts collecting messages instead of sending them.  See NOTE: Batching
+/// messages.
+#[no_mangle]
+pub unsafe extern "C" fn qubes_rust_begin_batch(backend: &mut RustBackend) {
+    backend.batching = true;
+}
+
+/// Sends the messages collected since qubes_rust_begin_batch() in a single
+/// write.
+#[no_mangle]
+pub unsafe extern "C" fn qubes_rust_end_batch(backend: &mut RustBackend) {
+    match std::panic::catch_unwind(std::panic::AssertUnwindSafe(|| backend.flush_batch())) {
+        Ok(()) => {}
+        Err(_) => {
+            core::mem::forget(std::panic::catch_unwind(|| {
+                eprintln!("Unexpected panic");
+            }));
+            std::process::abort();
+        }
+    }
+}
+
 #[no_mangle]
 pub unsafe extern "C" fn qubes_rust_backend_free(backend: *mut c_void) {
     if !backend.is_null() {
@@ -300,5 +352,7 @@ fn setup_qubes_backend(domid: u16) -> RustBackend {
         wid: 1,
         map: Default::default(),
         start: std::time::Instant::now(),
+        batch: Vec::new(),
+        batching: false,
     }
 }
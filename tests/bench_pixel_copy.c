@@ -0,0 +1,128 @@
+// Benchmark of qubes_pixel_copy() against compositing the same damage with
+// pixman, as the wlroots renderer does for a window with a single buffer
+
+#include "common.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <pixman.h>
+
+#include "qubes_pixel_diff.h"
+
+/* A 4K window */
+#define WIDTH 3840
+#define HEIGHT 2160
+#define STRIDE (WIDTH * sizeof(uint32_t))
+#define ITERATIONS 100
+
+static uint64_t now_ns(void)
+{
+	struct timespec now;
+	assert(clock_gettime(CLOCK_MONOTONIC, &now) == 0);
+	return (uint64_t)now.tv_sec * UINT64_C(1000000000) + (uint64_t)now.tv_nsec;
+}
+
+static uint64_t copy_direct(uint32_t *dst, const uint32_t *src,
+                            const pixman_region32_t *damage)
+{
+	return qubes_pixel_copy(dst, STRIDE, src, STRIDE, WIDTH, HEIGHT, damage);
+}
+
+/* What the pixman renderer does for one opaque buffer covering the output */
+static void copy_pixman(pixman_image_t *dst, pixman_image_t *src,
+                        pixman_region32_t *damage)
+{
+	const pixman_box32_t *box = pixman_region32_extents(damage);
+	assert(pixman_image_set_clip_region32(dst, damage));
+	pixman_image_composite32(PIXMAN_OP_SRC, src, NULL, dst, box->x1, box->y1, 0,
+	                         0, box->x1, box->y1, box->x2 - box->x1,
+	                         box->y2 - box->y1);
+	assert(pixman_image_set_clip_region32(dst, NULL));
+}
+
+/* The copier makes pixels opaque, pixman leaves the padding byte alone */
+static void check_same(const uint32_t *a, const uint32_t *b)
+{
+	for (size_t i = 0; i < (size_t)WIDTH * HEIGHT; ++i)
+		assert(((a[i] ^ b[i]) & 0x00FFFFFF) == 0);
+}
+
+static void run(const char *name, pixman_region32_t *damage,
+                const uint32_t *src, uint32_t *dst_direct, uint32_t *dst_pixman,
+                pixman_image_t *src_image, pixman_image_t *dst_image)
+{
+	uint64_t bytes = 0;
+
+	memset(dst_direct, 0, STRIDE * HEIGHT);
+	memset(dst_pixman, 0, STRIDE * HEIGHT);
+	copy_direct(dst_direct, src, damage);
+	copy_pixman(dst_image, src_image, damage);
+	check_same(dst_direct, dst_pixman);
+
+	uint64_t start = now_ns();
+	for (int i = 0; i < ITERATIONS; ++i)
+		bytes += copy_direct(dst_direct, src, damage);
+	const uint64_t direct_ns = now_ns() - start;
+	start = now_ns();
+	for (int i = 0; i < ITERATIONS; ++i)
+		copy_pixman(dst_image, src_image, damage);
+	const uint64_t pixman_ns = now_ns() - start;
+
+	printf("%-12s %4d rects %10" PRIu64 " bytes: qubes_pixel_copy %8.1f us"
+	       " (%5.2f GB/s), pixman %8.1f us (%5.2f GB/s), %.2fx\n",
+	       name, pixman_region32_n_rects(damage), bytes / ITERATIONS,
+	       direct_ns / 1e3 / ITERATIONS, (double)bytes / direct_ns,
+	       pixman_ns / 1e3 / ITERATIONS, (double)bytes / pixman_ns,
+	       (double)pixman_ns / direct_ns);
+}
+
+int main(void)
+{
+	uint32_t *src = malloc(STRIDE * HEIGHT);
+	uint32_t *dst_direct = malloc(STRIDE * HEIGHT);
+	uint32_t *dst_pixman = malloc(STRIDE * HEIGHT);
+	pixman_region32_t damage;
+
+	assert(src && dst_direct && dst_pixman);
+	for (size_t i = 0; i < (size_t)WIDTH * HEIGHT; ++i)
+		src[i] = (uint32_t)(i * 2654435761u);
+	pixman_image_t *src_image = pixman_image_create_bits_no_clear(
+	   PIXMAN_x8r8g8b8, WIDTH, HEIGHT, src, (int)STRIDE);
+	pixman_image_t *dst_image = pixman_image_create_bits_no_clear(
+	   PIXMAN_x8r8g8b8, WIDTH, HEIGHT, dst_pixman, (int)STRIDE);
+	assert(src_image && dst_image);
+
+	pixman_region32_init_rect(&damage, 0, 0, WIDTH, HEIGHT);
+	run("full frame", &damage, src, dst_direct, dst_pixman, src_image,
+	    dst_image);
+	pixman_region32_fini(&damage);
+
+	/* A terminal redrawing some of its lines */
+	pixman_region32_init(&damage);
+	for (int y = 0; y + 20 <= HEIGHT; y += 60)
+		pixman_region32_union_rect(&damage, &damage, 16, y, WIDTH - 32, 20);
+	run("text lines", &damage, src, dst_direct, dst_pixman, src_image,
+	    dst_image);
+	pixman_region32_fini(&damage);
+
+	/* Widgets updating all over a large window */
+	pixman_region32_init(&damage);
+	for (int y = 0; y + 64 <= HEIGHT; y += 256)
+		for (int x = (y / 256 % 2) * 128; x + 64 <= WIDTH; x += 256)
+			pixman_region32_union_rect(&damage, &damage, x, y, 64, 64);
+	run("small rects", &damage, src, dst_direct, dst_pixman, src_image,
+	    dst_image);
+	pixman_region32_fini(&damage);
+
+	pixman_image_unref(dst_image);
+	pixman_image_unref(src_image);
+	free(dst_pixman);
+	free(dst_direct);
+	free(src);
+	return 0;
+}
+// vim: set noet ts=3 sts=3 sw=3 ft=c fenc=UTF-8:
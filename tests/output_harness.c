@@ -0,0 +1,327 @@
+// Runs qubes_output.c against recorded messages instead of a GUI daemon
+
+#include "output_harness.h"
+
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <drm_fourcc.h>
+#include <pixman.h>
+#include <wlr/backend/interface.h>
+#include <wlr/interfaces/wlr_buffer.h>
+#include <wlr/render/allocator.h>
+#include <wlr/render/pixman.h>
+#include <wlr/render/wlr_renderer.h>
+#include <wlr/util/log.h>
+
+#include <qubes-gui-protocol.h>
+
+#include "qubes_allocator.h"
+#include "qubes_frame_clock.h"
+
+/* Stand-ins for the Rust side, which talks to the daemon over the vchan.
+ * The backend pointer it is given is the harness. */
+
+void qubes_rust_send_message(void *backend, struct msg_hdr *header)
+{
+	struct harness *h = backend;
+
+	switch (header->type) {
+	case MSG_SHMIMAGE: {
+		const struct msg_shmimage *image = (const void *)(header + 1);
+		assert(h->n_rects < HARNESS_MAX_RECTS);
+		h->rects[h->n_rects++] = (struct harness_rect){
+			.window = header->window,
+			.x = (int32_t)image->x,
+			.y = (int32_t)image->y,
+			.width = (int32_t)image->width,
+			.height = (int32_t)image->height,
+		};
+		break;
+	}
+	case MSG_WINDOW_DUMP:
+		h->dumps++;
+		break;
+	default:
+		break;
+	}
+}
+
+uint32_t qubes_rust_generate_id(void *backend, void *data)
+{
+	static uint32_t next_id = 1;
+	return next_id++;
+}
+
+void qubes_rust_begin_batch(void *backend)
+{
+}
+
+void qubes_rust_end_batch(void *backend)
+{
+}
+
+/* In qubes_window_position.c, which needs the rest of the compositor */
+void qubes_send_configure(struct qubes_output *output)
+{
+}
+
+static uint32_t harness_get_buffer_caps(struct wlr_backend *backend)
+{
+	return WLR_BUFFER_CAP_DATA_PTR;
+}
+
+static const struct wlr_backend_impl harness_backend_impl = {
+	.get_buffer_caps = harness_get_buffer_caps,
+};
+
+static void harness_buffer_destroy(struct wlr_buffer *raw_buffer)
+{
+	struct harness_buffer *buffer = wl_container_of(raw_buffer, buffer, base);
+	free(buffer->pixels);
+	free(buffer);
+}
+
+static bool harness_buffer_begin_data_ptr_access(struct wlr_buffer *raw_buffer,
+                                                 uint32_t flags, void **data,
+                                                 uint32_t *format,
+                                                 size_t *stride)
+{
+	struct harness_buffer *buffer = wl_container_of(raw_buffer, buffer, base);
+	*data = buffer->pixels;
+	*format = DRM_FORMAT_XRGB8888;
+	*stride = (size_t)raw_buffer->width * sizeof(uint32_t);
+	return true;
+}
+
+static void harness_buffer_end_data_ptr_access(struct wlr_buffer *raw_buffer)
+{
+}
+
+static const struct wlr_buffer_impl harness_buffer_impl = {
+	.destroy = harness_buffer_destroy,
+	.begin_data_ptr_access = harness_buffer_begin_data_ptr_access,
+	.end_data_ptr_access = harness_buffer_end_data_ptr_access,
+};
+
+static struct harness_buffer *harness_buffer_create(int32_t width,
+                                                    int32_t height)
+{
+	struct harness_buffer *buffer = calloc(1, sizeof(*buffer));
+
+	assert(buffer);
+	assert((buffer->pixels = calloc((size_t)width * (size_t)height,
+	                                sizeof(uint32_t))));
+	wlr_buffer_init(&buffer->base, &harness_buffer_impl, width, height);
+	return buffer;
+}
+
+void harness_init(struct harness *h)
+{
+	struct tinywl_server *server = &h->server;
+
+	memset(h, 0, sizeof(*h));
+	wlr_log_init(WLR_ERROR, NULL);
+	assert((h->display = wl_display_create()));
+	h->loop = wl_display_get_event_loop(h->display);
+	wlr_backend_init(&h->backend.backend, &harness_backend_impl);
+	h->backend.display = h->display;
+	h->backend.rust_backend = (struct qubes_rust_backend *)h;
+	h->backend.protocol_version = 0x10007;
+
+	server->magic = QUBES_SERVER_MAGIC;
+	server->wl_display = h->display;
+	server->backend = &h->backend;
+	wl_list_init(&server->views);
+	wl_list_init(&server->frame_outputs);
+	wl_list_init(&server->render_outputs);
+	server->hidden_reclaim_ms = -1;
+	server->hidden_frame_ms = -1;
+	server->refresh_mhz = 60000;
+	assert((server->allocator = qubes_allocator_create(0, QUBES_ALLOCATOR_SHM)));
+	assert((server->renderer = wlr_pixman_renderer_create()));
+	assert(qubes_frame_clock_init(&server->frame_clock, h->loop,
+	                              server->refresh_mhz, qubes_output_frame_tick,
+	                              server));
+}
+
+void harness_finish(struct harness *h)
+{
+	struct tinywl_server *server = &h->server;
+
+	assert(wl_list_empty(&server->views));
+	qubes_frame_clock_finish(&server->frame_clock);
+	wlr_renderer_destroy(server->renderer);
+	wlr_allocator_destroy(server->allocator);
+	wl_display_destroy(h->display);
+}
+
+void harness_clear_messages(struct harness *h)
+{
+	h->n_rects = 0;
+	h->dumps = 0;
+}
+
+static int64_t harness_now_ms(void)
+{
+	struct timespec now;
+	assert(clock_gettime(CLOCK_MONOTONIC, &now) == 0);
+	return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/* What qubes_parse_event() does for each MSG_WINDOW_DUMP_ACK */
+static void harness_ack_dumps(struct harness *h)
+{
+	struct tinywl_server *server = &h->server;
+	struct qubes_link *link;
+
+	while ((link = server->queue_head) != NULL) {
+		if ((server->queue_head = link->next) == NULL)
+			server->queue_tail = NULL;
+		qubes_output_dump_acked(server, link);
+	}
+}
+
+unsigned int harness_run_for(struct harness *h, int ms)
+{
+	const int64_t end = harness_now_ms() + ms;
+	struct pollfd pollfd = {
+		.fd = wl_event_loop_get_fd(h->loop),
+		.events = POLLIN,
+	};
+	unsigned int wakeups = 0;
+
+	for (;;) {
+		wl_event_loop_dispatch_idle(h->loop);
+		harness_ack_dumps(h);
+		const int64_t left = end - harness_now_ms();
+		if (left <= 0)
+			return wakeups;
+		/* Timers and other event sources all go through this fd */
+		if (poll(&pollfd, 1, (int)left) > 0) {
+			wakeups++;
+			assert(wl_event_loop_dispatch(h->loop, 0) == 0);
+		}
+	}
+}
+
+void harness_window_init(struct harness *h, struct harness_window *w,
+                         bool override_redirect, struct wlr_box box)
+{
+	memset(w, 0, sizeof(*w));
+	assert(qubes_output_init(&w->output, &h->server, override_redirect, NULL,
+	                         QUBES_XWAYLAND_MAGIC, box.x, box.y,
+	                         (uint32_t)box.width, (uint32_t)box.height));
+	/* Stands in for the tree of the client's surface */
+	assert((w->output.scene_subsurface_tree =
+	           wlr_scene_tree_create(&w->output.scene->tree)));
+	w->buffer = harness_buffer_create(box.width, box.height);
+	assert((w->scene_buffer = wlr_scene_buffer_create(
+	           w->output.scene_subsurface_tree, &w->buffer->base)));
+	assert(qubes_output_configure(&w->output, box));
+	qubes_output_map(&w->output, 0, override_redirect);
+}
+
+void harness_window_finish(struct harness_window *w)
+{
+	qubes_output_deinit(&w->output);
+	wlr_buffer_drop(&w->buffer->base);
+	free(w->shown);
+}
+
+void harness_window_draw(struct harness_window *w, struct wlr_box box,
+                         uint32_t color)
+{
+	const int32_t width = w->buffer->base.width;
+	pixman_region32_t damage;
+
+	assert(box.x >= 0 && box.y >= 0 && box.x + box.width <= width &&
+	       box.y + box.height <= w->buffer->base.height);
+	for (int32_t y = box.y; y < box.y + box.height; ++y)
+		for (int32_t x = box.x; x < box.x + box.width; ++x)
+			w->buffer->pixels[y * width + x] = color;
+	pixman_region32_init_rect(&damage, box.x, box.y, (unsigned)box.width,
+	                          (unsigned)box.height);
+	wlr_scene_buffer_set_buffer_with_damage(w->scene_buffer, &w->buffer->base,
+	                                        &damage);
+	pixman_region32_fini(&damage);
+}
+
+void harness_window_configure(struct harness_window *w, struct wlr_box box)
+{
+	if (box.width != w->buffer->base.width ||
+	    box.height != w->buffer->base.height) {
+		/* The client draws a new, black buffer at the new size */
+		struct harness_buffer *old = w->buffer;
+		w->buffer = harness_buffer_create(box.width, box.height);
+		wlr_scene_buffer_set_buffer(w->scene_buffer, &w->buffer->base);
+		wlr_buffer_drop(&old->base);
+	}
+	assert(qubes_output_configure(&w->output, box));
+}
+
+unsigned int harness_window_rects(struct harness *h, struct harness_window *w,
+                                  struct harness_rect *out, unsigned int max)
+{
+	unsigned int n = 0;
+
+	for (unsigned int i = 0; i < h->n_rects; ++i) {
+		if (h->rects[i].window != w->output.window_id)
+			continue;
+		assert(n < max);
+		out[n++] = h->rects[i];
+	}
+	return n;
+}
+
+static bool harness_rects_cover(const struct harness_rect *rects,
+                                unsigned int n, int32_t x, int32_t y)
+{
+	for (unsigned int i = 0; i < n; ++i)
+		if (x >= rects[i].x && x < rects[i].x + rects[i].width &&
+		    y >= rects[i].y && y < rects[i].y + rects[i].height)
+			return true;
+	return false;
+}
+
+void harness_window_check_dump(struct harness *h, struct harness_window *w)
+{
+	struct harness_rect rects[HARNESS_MAX_RECTS];
+	const unsigned int n = harness_window_rects(h, w, rects, HARNESS_MAX_RECTS);
+	struct wlr_buffer *dumped = w->output.buffer;
+	void *data;
+	uint32_t format;
+	size_t stride;
+
+	assert(dumped);
+	const int32_t width = dumped->width, height = dumped->height;
+	assert(width == w->buffer->base.width && height == w->buffer->base.height);
+	/* The daemon does not keep the contents of a resized window */
+	const bool resized =
+	   !w->shown || width != w->shown_width || height != w->shown_height;
+	assert(wlr_buffer_begin_data_ptr_access(
+	   dumped, WLR_BUFFER_DATA_PTR_ACCESS_READ, &data, &format, &stride));
+	for (int32_t y = 0; y < height; ++y) {
+		const uint32_t *row = (const uint32_t *)((char *)data + y * stride);
+		for (int32_t x = 0; x < width; ++x) {
+			const uint32_t pixel = row[x] & 0x00FFFFFF;
+			assert(pixel == (w->buffer->pixels[y * width + x] & 0x00FFFFFF));
+			if (resized || pixel != w->shown[y * width + x])
+				assert(harness_rects_cover(rects, n, x, y));
+		}
+	}
+	free(w->shown);
+	assert((w->shown = calloc((size_t)width * (size_t)height,
+	                          sizeof(uint32_t))));
+	for (int32_t y = 0; y < height; ++y) {
+		const uint32_t *row = (const uint32_t *)((char *)data + y * stride);
+		for (int32_t x = 0; x < width; ++x)
+			w->shown[y * width + x] = row[x] & 0x00FFFFFF;
+	}
+	w->shown_width = width;
+	w->shown_height = height;
+	wlr_buffer_end_data_ptr_access(dumped);
+}
+// vim: set noet ts=3 sts=3 sw=3 ft=c fenc=UTF-8:
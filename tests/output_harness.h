@@ -0,0 +1,86 @@
+#ifndef QUBES_WAYLAND_COMPOSITOR_TESTS_OUTPUT_HARNESS_H
+#define QUBES_WAYLAND_COMPOSITOR_TESTS_OUTPUT_HARNESS_H                        \
+	_Pragma("GCC error \"double-include guard referenced\"")
+
+/*
+ * Runs qubes_output.c without a GUI daemon: the messages it would send are
+ * recorded instead, and windows show a buffer the test draws into rather
+ * than a client's surface.
+ */
+
+#include "common.h"
+
+#include <wayland-server-core.h>
+#include <wlr/types/wlr_buffer.h>
+#include <wlr/types/wlr_scene.h>
+#include <wlr/util/box.h>
+
+#include "main.h"
+#include "qubes_backend.h"
+#include "qubes_output.h"
+
+/* A MSG_SHMIMAGE as sent to the daemon */
+struct harness_rect {
+	uint32_t window;
+	int32_t x, y, width, height;
+};
+
+#define HARNESS_MAX_RECTS 64
+
+struct harness {
+	struct wl_display *display;
+	struct wl_event_loop *loop;
+	struct qubes_backend backend;
+	struct tinywl_server server;
+	/* Recorded since harness_clear_messages() */
+	struct harness_rect rects[HARNESS_MAX_RECTS];
+	unsigned int n_rects;
+	unsigned int dumps; /* MSG_WINDOW_DUMP */
+};
+
+struct harness_buffer {
+	struct wlr_buffer base;
+	uint32_t *pixels; /* XRGB8888, without padding */
+};
+
+/* A window whose surface is a single buffer, like most X11 windows */
+struct harness_window {
+	struct qubes_output output;
+	struct harness_buffer *buffer;
+	struct wlr_scene_buffer *scene_buffer;
+	/* What the daemon was last sent, to compare the next dump against */
+	uint32_t *shown;
+	int32_t shown_width, shown_height;
+};
+
+void harness_init(struct harness *h);
+void harness_finish(struct harness *h);
+void harness_clear_messages(struct harness *h);
+/*
+ * Runs the event loop for ms milliseconds, answering every dump with a
+ * DUMP_ACK as a prompt daemon would.  Returns how often the loop woke up.
+ */
+unsigned int harness_run_for(struct harness *h, int ms);
+
+/* Creates, configures and maps a window showing a black buffer */
+void harness_window_init(struct harness *h, struct harness_window *w,
+                         bool override_redirect, struct wlr_box box);
+void harness_window_finish(struct harness_window *w);
+/* Fills box with color and damages exactly that */
+void harness_window_draw(struct harness_window *w, struct wlr_box box,
+                         uint32_t color);
+/* Configures a new size or position, as the daemon or the client would */
+void harness_window_configure(struct harness_window *w, struct wlr_box box);
+/*
+ * Checks the last dump against the client's pixels and against the dump
+ * before it: the pixels the daemon was sent must be the client's, and every
+ * pixel that changed must be covered by a MSG_SHMIMAGE of the window.  Then
+ * remembers the dump for next time.
+ */
+void harness_window_check_dump(struct harness *h, struct harness_window *w);
+/* The MSG_SHMIMAGE rectangles of the window since harness_clear_messages() */
+unsigned int harness_window_rects(struct harness *h, struct harness_window *w,
+                                  struct harness_rect *out, unsigned int max);
+
+#endif
+// vim: set noet ts=3 sts=3 sw=3 ft=c fenc=UTF-8:
@@ -0,0 +1,154 @@
+// Tests for qubes_damage_coalesce()
+
+#include "common.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "qubes_damage.h"
+
+#define BOX(a, b, c, d) ((pixman_box32_t){ .x1 = a, .y1 = b, .x2 = c, .y2 = d })
+
+static bool box_contains(const pixman_box32_t *outer,
+                         const pixman_box32_t *inner)
+{
+	return outer->x1 <= inner->x1 && outer->y1 <= inner->y1 &&
+	       outer->x2 >= inner->x2 && outer->y2 >= inner->y2;
+}
+
+static bool box_equal(const pixman_box32_t *a, const pixman_box32_t *b)
+{
+	return a->x1 == b->x1 && a->y1 == b->y1 && a->x2 == b->x2 &&
+	       a->y2 == b->y2;
+}
+
+/*
+ * Checks what must hold for any input: the result fits in a frame's worth of
+ * messages, every non-empty input rectangle is sent as part of some output
+ * rectangle, and no two output rectangles would be cheaper to send merged.
+ */
+static int coalesce_checked(const pixman_box32_t *rects, int n_rects,
+                            uint32_t message_cost, pixman_box32_t *out)
+{
+	const int n_out = qubes_damage_coalesce(rects, n_rects, message_cost, out);
+	assert(n_out >= 0 && n_out <= QUBES_DAMAGE_MAX_RECTS);
+	for (int i = 0; i < n_rects; ++i) {
+		if (rects[i].x2 <= rects[i].x1 || rects[i].y2 <= rects[i].y1)
+			continue;
+		bool covered = false;
+		for (int j = 0; j < n_out && !covered; ++j)
+			covered = box_contains(&out[j], &rects[i]);
+		assert(covered);
+	}
+	for (int i = 0; i < n_out; ++i) {
+		assert(qubes_box_area(&out[i]) > 0);
+		for (int j = i + 1; j < n_out; ++j) {
+			const pixman_box32_t merged = {
+				.x1 = QUBES_MIN(out[i].x1, out[j].x1),
+				.y1 = QUBES_MIN(out[i].y1, out[j].y1),
+				.x2 = QUBES_MAX(out[i].x2, out[j].x2),
+				.y2 = QUBES_MAX(out[i].y2, out[j].y2),
+			};
+			assert(qubes_box_area(&merged) - qubes_box_area(&out[i]) -
+			          qubes_box_area(&out[j]) >
+			       (int64_t)message_cost);
+		}
+	}
+	return n_out;
+}
+
+static void test_empty(void)
+{
+	const pixman_box32_t rects[] = {
+		BOX(0, 0, 0, 10),
+		BOX(5, 5, 4, 6),
+		BOX(0, 10, 10, 10),
+	};
+	pixman_box32_t out[QUBES_DAMAGE_MAX_RECTS];
+
+	assert(coalesce_checked(rects, 3, 4096, out) == 0);
+	assert(coalesce_checked(rects, 0, 4096, out) == 0);
+}
+
+static void test_adjacent(void)
+{
+	/* Two halves of one band, as pixman reports them */
+	const pixman_box32_t rects[] = {
+		BOX(0, 0, 10, 10),
+		BOX(10, 0, 20, 10),
+	};
+	pixman_box32_t out[QUBES_DAMAGE_MAX_RECTS];
+
+	assert(coalesce_checked(rects, 2, 1, out) == 1);
+	assert(box_equal(&out[0], &BOX(0, 0, 20, 10)));
+}
+
+static void test_far_apart(void)
+{
+	const pixman_box32_t rects[] = {
+		BOX(0, 0, 10, 10),
+		BOX(1000, 1000, 1010, 1010),
+	};
+	pixman_box32_t out[QUBES_DAMAGE_MAX_RECTS];
+
+	/* Merging would send a million pixels to save one message */
+	assert(coalesce_checked(rects, 2, 4096, out) == 2);
+	assert(box_equal(&out[0], &rects[0]));
+	assert(box_equal(&out[1], &rects[1]));
+
+	/* Unless messages cost even more than that */
+	assert(coalesce_checked(rects, 2, UINT32_MAX, out) == 1);
+	assert(box_equal(&out[0], &BOX(0, 0, 1010, 1010)));
+}
+
+static void test_pairs(void)
+{
+	/*
+	 * A text cursor blinking in the top left and a clock in the bottom
+	 * right, each damaged as two adjacent pieces in different bands.
+	 * Neighbours in y-x order are not the pieces that belong together, so
+	 * this relies on the final pairwise merging.
+	 */
+	const pixman_box32_t rects[] = {
+		BOX(10, 10, 12, 30),
+		BOX(1800, 10, 1900, 20),
+		BOX(10, 30, 12, 50),
+		BOX(1800, 20, 1900, 30),
+	};
+	pixman_box32_t out[QUBES_DAMAGE_MAX_RECTS];
+
+	assert(coalesce_checked(rects, 4, 4096, out) == 2);
+	assert((box_equal(&out[0], &BOX(10, 10, 12, 50)) &&
+	        box_equal(&out[1], &BOX(1800, 10, 1900, 30))) ||
+	       (box_equal(&out[1], &BOX(10, 10, 12, 50)) &&
+	        box_equal(&out[0], &BOX(1800, 10, 1900, 30))));
+}
+
+static void test_many(void)
+{
+	/* A sparse grid of single pixels, far more than can be sent */
+	enum { GRID = 40, SPACING = 100 };
+	pixman_box32_t *rects = calloc(GRID * GRID, sizeof(*rects));
+	pixman_box32_t out[QUBES_DAMAGE_MAX_RECTS];
+
+	assert(rects);
+	for (int y = 0; y < GRID; ++y)
+		for (int x = 0; x < GRID; ++x)
+			rects[y * GRID + x] = BOX(x * SPACING, y * SPACING,
+			                          x * SPACING + 1, y * SPACING + 1);
+	for (uint32_t cost = 1; cost <= 1 << 20; cost <<= 4)
+		assert(coalesce_checked(rects, GRID * GRID, cost, out) > 0);
+	free(rects);
+}
+
+int main(void)
+{
+	test_empty();
+	test_adjacent();
+	test_far_apart();
+	test_pairs();
+	test_many();
+	printf("damage coalescing: all tests passed\n");
+	return 0;
+}
+// vim: set noet ts=3 sts=3 sw=3 ft=c fenc=UTF-8:
@@ -0,0 +1,160 @@
+// Tests that the frame clock, and the windows it drives, do not wake up an
+// idle event loop
+
+#include "common.h"
+
+#include <stdio.h>
+#include <time.h>
+
+#include <wayland-server-core.h>
+
+#include "output_harness.h"
+#include "qubes_frame_clock.h"
+
+/* Long enough for 15 ticks at 60 Hz */
+#define IDLE_MS 250
+
+struct counter {
+	struct qubes_frame_clock *clock;
+	unsigned int calls;
+	unsigned int again; /* ticks to schedule from within the tick */
+};
+
+static void count_tick(void *data)
+{
+	struct counter *counter = data;
+
+	counter->calls++;
+	if (counter->again) {
+		counter->again--;
+		qubes_frame_clock_schedule(counter->clock);
+	}
+}
+
+static int64_t now_ms(void)
+{
+	struct timespec now;
+	assert(clock_gettime(CLOCK_MONOTONIC, &now) == 0);
+	return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/* Runs the event loop for ms milliseconds, whatever wakes it up */
+static void run_for(struct wl_event_loop *loop, int ms)
+{
+	const int64_t end = now_ms() + ms;
+	for (int64_t left; (left = end - now_ms()) > 0;)
+		assert(wl_event_loop_dispatch(loop, (int)left) == 0);
+}
+
+/*
+ * Runs the compositor until window is idle, then checks that it stays so:
+ * no timer of its own and no frame tick may wake the event loop up again.
+ */
+static void assert_output_settles(struct harness *h,
+                                  struct harness_window *window)
+{
+	struct qubes_frame_clock *clock = &h->server.frame_clock;
+
+	harness_run_for(h, IDLE_MS);
+	const uint64_t ticks = clock->ticks;
+	assert(harness_run_for(h, IDLE_MS) == 0);
+	assert(clock->ticks == ticks && !clock->pending);
+	assert(wl_list_empty(&window->output.frame_link));
+	assert(!window->output.present_idle);
+	harness_clear_messages(h);
+}
+
+/* qubes_output_frame_tick() driving a window, with everything that arms a
+ * timer or an idle source for it */
+static void test_output(void)
+{
+	struct wlr_box const box = { .x = 0, .y = 0, .width = 64, .height = 48 };
+	struct wlr_box const dirty = { .x = 1, .y = 2, .width = 3, .height = 4 };
+	struct harness h;
+	struct harness_window window;
+
+	harness_init(&h);
+	struct qubes_frame_clock *clock = &h.server.frame_clock;
+	harness_window_init(&h, &window, false, box);
+	assert_output_settles(&h, &window);
+
+	/* Drawing once commits a frame and schedules a tick.  That tick finds
+	 * no damage and no frame request, so it does not schedule another. */
+	const uint64_t ticks = clock->ticks;
+	harness_window_draw(&window, dirty, 0xFF0000);
+	assert_output_settles(&h, &window);
+	assert(clock->ticks == ticks + 1);
+
+	/* Daemons before protocol 1.7 get presentation from an idle source */
+	h.backend.protocol_version = 0x10006;
+	harness_window_draw(&window, dirty, 0x00FF00);
+	assert_output_settles(&h, &window);
+	h.backend.protocol_version = 0x10007;
+
+	/* The resize settle timer fires once */
+	qubes_output_note_resize(&window.output, 0, 64, 48);
+	assert(harness_run_for(&h, IDLE_MS * 2) == 1);
+	assert_output_settles(&h, &window);
+
+	/* A hidden window that asks for a frame gets one from its own timer */
+	h.server.hidden_frame_ms = 20;
+	qubes_output_set_minimized(&window.output, true);
+	wlr_output_update_needs_frame(&window.output.output);
+	assert(harness_run_for(&h, IDLE_MS) == 1);
+	assert(!window.output.hidden_frame_armed);
+	assert_output_settles(&h, &window);
+	qubes_output_set_minimized(&window.output, false);
+	assert_output_settles(&h, &window);
+
+	/* Buffers of hidden windows are reclaimed once, and rebuilt when the
+	 * window is shown */
+	h.server.hidden_reclaim_ms = 20;
+	qubes_output_set_minimized(&window.output, true);
+	assert(harness_run_for(&h, IDLE_MS) == 1);
+	assert(window.output.flags & QUBES_OUTPUT_RECLAIMED);
+	assert_output_settles(&h, &window);
+	qubes_output_set_minimized(&window.output, false);
+	assert_output_settles(&h, &window);
+	assert(!(window.output.flags & QUBES_OUTPUT_RECLAIMED));
+
+	harness_window_finish(&window);
+	harness_finish(&h);
+}
+
+int main(void)
+{
+	struct wl_event_loop *loop = wl_event_loop_create();
+	struct qubes_frame_clock clock;
+	struct counter counter = { .clock = &clock };
+
+	assert(loop);
+	assert(qubes_frame_clock_init(&clock, loop, 60000, count_tick, &counter));
+
+	/* Nothing waits for a frame, so the timer must never fire */
+	run_for(loop, IDLE_MS);
+	assert(clock.ticks == 0 && counter.calls == 0 && !clock.pending);
+
+	/* Scheduling twice before the tick still gives a single tick */
+	qubes_frame_clock_schedule(&clock);
+	qubes_frame_clock_schedule(&clock);
+	assert(clock.pending);
+	run_for(loop, IDLE_MS);
+	assert(clock.ticks == 1 && counter.calls == 1 && !clock.pending);
+
+	/* A window that keeps drawing gets a tick per frame, and once it
+	 * stops, the compositor goes back to sleep */
+	counter.again = 5;
+	qubes_frame_clock_schedule(&clock);
+	run_for(loop, IDLE_MS);
+	assert(clock.ticks == 7 && counter.calls == 7 && !clock.pending);
+	const uint64_t ticks = clock.ticks;
+	run_for(loop, IDLE_MS);
+	assert(clock.ticks == ticks);
+
+	qubes_frame_clock_finish(&clock);
+	wl_event_loop_destroy(loop);
+	test_output();
+	printf("frame clock: all tests passed\n");
+	return 0;
+}
+// vim: set noet ts=3 sts=3 sw=3 ft=c fenc=UTF-8:
@@ -0,0 +1,146 @@
+// Tests that the MSG_SHMIMAGE rectangles sent for Xwayland windows match what
+// changed, see qubes_output_damage()
+
+#include "common.h"
+
+#include <stdio.h>
+
+#include "output_harness.h"
+
+/* Long enough for a few frame ticks at 60 Hz */
+#define FRAME_MS 100
+
+#define BOX(a, b, c, d)                                                        \
+	((struct wlr_box){ .x = a, .y = b, .width = c, .height = d })
+
+static bool rect_is(const struct harness_rect *rect, struct wlr_box box)
+{
+	return rect->x == box.x && rect->y == box.y && rect->width == box.width &&
+	       rect->height == box.height;
+}
+
+/* Runs until the window has drawn, and checks that exactly box was sent */
+static void expect_rect(struct harness *h, struct harness_window *w,
+                        struct wlr_box box)
+{
+	struct harness_rect rects[HARNESS_MAX_RECTS];
+
+	harness_run_for(h, FRAME_MS);
+	const unsigned int n = harness_window_rects(h, w, rects, HARNESS_MAX_RECTS);
+	assert(n == 1 && rect_is(&rects[0], box));
+	harness_window_check_dump(h, w);
+	harness_clear_messages(h);
+}
+
+/* Runs for a while, and checks that nothing was sent */
+static void expect_nothing(struct harness *h)
+{
+	harness_run_for(h, FRAME_MS);
+	assert(h->n_rects == 0 && h->dumps == 0);
+}
+
+static void first_frame(struct harness *h, struct harness_window *w,
+                        struct wlr_box box)
+{
+	struct harness_rect rects[HARNESS_MAX_RECTS];
+
+	/* Whatever was sent while mapping, the last dump covers the window */
+	harness_run_for(h, FRAME_MS);
+	const unsigned int n = harness_window_rects(h, w, rects, HARNESS_MAX_RECTS);
+	assert(n > 0 &&
+	       rect_is(&rects[n - 1], BOX(0, 0, box.width, box.height)));
+	harness_window_check_dump(h, w);
+	harness_clear_messages(h);
+}
+
+/* An X11 application redrawing part of its window */
+static void test_partial_redraw(struct harness *h, struct harness_window *w)
+{
+	harness_window_draw(w, BOX(20, 30, 10, 10), 0xFF0000);
+	expect_rect(h, w, BOX(20, 30, 10, 10));
+	harness_window_draw(w, BOX(0, 0, 1, 1), 0x00FF00);
+	expect_rect(h, w, BOX(0, 0, 1, 1));
+	harness_window_draw(w, BOX(100, 50, 60, 20), 0x0000FF);
+	expect_rect(h, w, BOX(100, 50, 60, 20));
+}
+
+/* Moves keep the contents, and later damage is still window-relative */
+static void test_move(struct harness *h, struct harness_window *w,
+                      struct wlr_box box)
+{
+	box.x += 37;
+	box.y -= 11;
+	harness_window_configure(w, box);
+	expect_nothing(h);
+	harness_window_draw(w, BOX(5, 6, 7, 8), 0x123456);
+	expect_rect(h, w, BOX(5, 6, 7, 8));
+}
+
+/* The daemon drops the contents of a resized window, even if the size
+ * changes back before the next frame */
+static void test_resize(struct harness *h, struct harness_window *w,
+                        struct wlr_box box)
+{
+	struct wlr_box const bigger = BOX(box.x, box.y, box.width + 40, box.height);
+
+	harness_window_configure(w, bigger);
+	harness_window_draw(w, BOX(0, 0, 10, 10), 0xABCDEF);
+	expect_rect(h, w, BOX(0, 0, bigger.width, bigger.height));
+
+	harness_window_configure(w, BOX(box.x, box.y, box.width, box.height + 8));
+	harness_window_configure(w, box);
+	harness_window_draw(w, BOX(0, 0, 10, 10), 0xABCDEF);
+	expect_rect(h, w, BOX(0, 0, box.width, box.height));
+}
+
+/* An override-redirect menu over the window, with an item highlighted as
+ * the pointer moves over it */
+static void test_menu(struct harness *h, struct harness_window *parent)
+{
+	struct wlr_box box = BOX(100, 120, 150, 200);
+	struct harness_window menu;
+
+	harness_window_init(h, &menu, true, box);
+	first_frame(h, &menu, box);
+	harness_window_draw(&menu, BOX(2, 22, 146, 20), 0x3050A0);
+	expect_rect(h, &menu, BOX(2, 22, 146, 20));
+	harness_window_draw(&menu, BOX(2, 22, 146, 20), 0xE0E0E0);
+	harness_window_draw(&menu, BOX(2, 42, 146, 20), 0x3050A0);
+	expect_rect(h, &menu, BOX(2, 22, 146, 40));
+
+	/* Submenus get moved next to their parent item after mapping */
+	box.x += 150;
+	harness_window_configure(&menu, box);
+	expect_nothing(h);
+
+	/* The window below does not get damaged by any of this */
+	harness_window_draw(parent, BOX(1, 2, 3, 4), 0x777777);
+	expect_rect(h, parent, BOX(1, 2, 3, 4));
+	harness_window_finish(&menu);
+	harness_clear_messages(h);
+}
+
+int main(void)
+{
+	struct wlr_box const box = BOX(10, 20, 320, 240);
+	struct harness h;
+	struct harness_window window;
+
+	harness_init(&h);
+	/* Every change is sent as it is */
+	h.server.damage_message_cost = 0;
+	h.server.damage_diff = false;
+	harness_window_init(&h, &window, false, box);
+	first_frame(&h, &window, box);
+
+	test_partial_redraw(&h, &window);
+	test_move(&h, &window, box);
+	test_resize(&h, &window, box);
+	test_menu(&h, &window);
+
+	harness_window_finish(&window);
+	harness_finish(&h);
+	printf("output damage: all tests passed\n");
+	return 0;
+}
+// vim: set noet ts=3 sts=3 sw=3 ft=c fenc=UTF-8: